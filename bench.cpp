@@ -0,0 +1,373 @@
+#include "compressedlog.h"
+#include "lz.h"
+#include "menu.h"
+#include "renderer.h"
+#include "ringbuffer.h"
+#include "screen.h"
+#include "scrollback.h"
+#include "session.h"
+#include "sharedring.h"
+#include "spawner.h"
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+/* Each benchmark is calibrated to run for at least MIN_RUN_NS, then timed
+   RUNS times, the median being reported */
+const uint64_t MIN_RUN_NS = 50 * 1000000;
+const int RUNS = 5;
+
+const size_t KIB = 1024;
+const size_t MIB = 1024 * 1024;
+
+/* One measurement, printed as a JSON object. bytes is how many bytes one
+   operation processes, for throughput, or 0 */
+struct Result {
+  std::string name;
+  std::string params;
+  uint64_t ops;
+  uint64_t bytes;
+  double nsPerOp;
+};
+
+std::vector<Result> results;
+
+/* Swallows frames and Menu output, so input processing can be timed without a
+   real terminal */
+class NullTerminal : public Terminal {
+public:
+  NullTerminal(int rows, int cols):
+    Terminal(rows, cols)
+  {}
+
+  void send(const std::string &) override
+  {}
+};
+
+/* Deterministic output resembling a busy shell: numbered log lines, some of
+   them coloured, so the same input is measured on every run */
+std::string sampleOutput(size_t len)
+{
+  static const char *words[] = {
+    "build", "error:", "warning:", "src/session.cpp", "linking", "ok",
+    "test", "passed", "-O2", "ms", "0x7ffd", "compiling"
+  };
+  std::string res;
+  uint32_t state = 12345;
+  int line = 0;
+
+  while (res.size() < len) {
+    res += "[" + std::to_string(line++) + "] ";
+    int n = 4 + line % 9;
+    for (int i=0; i<n; ++i) {
+      state = state * 1103515245 + 12345;
+      const char *word = words[(state >> 16) % 12];
+      if (!((state >> 8) % 7)) {
+        res += std::string("\x1b[31m") + word + "\x1b[0m ";
+      } else {
+        res += std::string(word) + " ";
+      }
+    }
+    res += "\r\n";
+  }
+
+  res.resize(len);
+  return res;
+}
+
+/* Time op, which processes bytes bytes per call, and record the median */
+void bench(const std::string &name, const std::string &params, uint64_t bytes,
+  std::function<void()> op)
+{
+  uint64_t ops = 1;
+  while (true) {
+    uint64_t start = monotonicNs();
+    for (uint64_t i=0; i<ops; ++i) {
+      op();
+    }
+    if (monotonicNs() - start >= MIN_RUN_NS) {
+      break;
+    }
+    ops *= 2;
+  }
+
+  std::vector<double> runs;
+  for (int run=0; run<RUNS; ++run) {
+    uint64_t start = monotonicNs();
+    for (uint64_t i=0; i<ops; ++i) {
+      op();
+    }
+    runs.push_back((double) (monotonicNs() - start) / ops);
+  }
+
+  std::sort(runs.begin(), runs.end());
+  results.push_back({name, params, ops, bytes, runs[RUNS / 2]});
+  fprintf(stderr, "%-28s %-32s %12.1f ns/op\n", name.c_str(), params.c_str(),
+    runs[RUNS / 2]);
+}
+
+std::string sizeParams(size_t capacity, size_t chunk)
+{
+  return "{\"capacity\": " + std::to_string(capacity) + ", \"chunk\": " +
+    std::to_string(chunk) + "}";
+}
+
+void benchRingBuffer(const std::string &data)
+{
+  std::vector<char> into(64 * KIB);
+
+  for (size_t capacity : {64 * KIB, 1 * MIB, 16 * MIB}) {
+    for (size_t chunk : {16UL, 256UL, 4 * KIB, 64 * KIB}) {
+      RingBuffer ring(capacity);
+      size_t pos = 0;
+
+      bench("ringbuffer_write", sizeParams(capacity, chunk), chunk, [&]() {
+        ring.write(data.data() + pos, chunk);
+        pos = (pos + chunk) % (data.size() - chunk);
+      });
+
+      bench("ringbuffer_write_read", sizeParams(capacity, chunk), chunk,
+        [&]() {
+          ring.write(data.data() + pos, chunk);
+          ring.read(&into[0], chunk);
+          pos = (pos + chunk) % (data.size() - chunk);
+        });
+    }
+  }
+}
+
+/* Filling the space at the tail in place, as readWindow() does */
+void benchSharedRing(const std::string &data)
+{
+  for (size_t chunk : {256UL, 4 * KIB}) {
+    SharedRing ring(HOT_CAPACITY);
+    size_t pos = 0;
+
+    bench("sharedring_reserve_commit", sizeParams(HOT_CAPACITY, chunk), chunk,
+      [&]() {
+        size_t len = chunk;
+        char *into = ring.reserve(len);
+        memcpy(into, data.data() + pos, len);
+        ring.commit(len);
+        pos = (pos + chunk) % (data.size() - chunk);
+      });
+  }
+}
+
+/* Compress then decompress src, failing unless the original comes back */
+void checkRoundTrip(const std::string &name, const std::string &src)
+{
+  std::string packed(lzBound(src.size()), '\0');
+  packed.resize(lzCompress(src.data(), src.size(), &packed[0],
+    packed.size()));
+
+  std::string unpacked(src.size(), '\0');
+  ssize_t len = lzDecompress(packed.data(), packed.size(), &unpacked[0],
+    unpacked.size());
+  if (len != (ssize_t) src.size() || unpacked != src) {
+    throw std::runtime_error("lz round trip failed for " + name);
+  }
+}
+
+/* The codec behind the cold store, a block at a time as CompressedLog uses
+   it. Every block of the sample, and inputs at the edges of the format (too
+   short to match, runs long enough for extra length bytes, nothing to match
+   at all), must round trip before anything is timed */
+void benchCompress(const std::string &data)
+{
+  for (size_t pos=0; pos<data.size(); pos+=BLOCK_SIZE) {
+    checkRoundTrip("sample block at " + std::to_string(pos),
+      data.substr(pos, BLOCK_SIZE));
+  }
+  checkRoundTrip("empty input", "");
+  checkRoundTrip("short input", "abcabcab");
+  checkRoundTrip("one byte run", std::string(BLOCK_SIZE, 'x'));
+
+  std::string noise(BLOCK_SIZE, '\0');
+  uint32_t state = 12345;
+  for (char &c : noise) {
+    state = state * 1103515245 + 12345;
+    c = state >> 16;
+  }
+  checkRoundTrip("noise", noise);
+
+  std::string block = data.substr(0, BLOCK_SIZE);
+  std::string packed(lzBound(block.size()), '\0');
+  std::string unpacked(block.size(), '\0');
+  size_t len = 0;
+  std::string params = "{\"block\": " + std::to_string(BLOCK_SIZE) + "}";
+
+  bench("lz_compress", params, block.size(), [&]() {
+    len = lzCompress(block.data(), block.size(), &packed[0], packed.size());
+  });
+  bench("lz_decompress", params, block.size(), [&]() {
+    lzDecompress(packed.data(), len, &unpacked[0], unpacked.size());
+  });
+}
+
+/* Everything a window's output goes through on the way in: the scrollback
+   with its cold store and indexes, then the screen */
+void benchOutputPath(const std::string &data)
+{
+  const size_t chunk = 4 * KIB;
+
+  for (size_t capacity : {HOT_CAPACITY, 16 * MIB}) {
+    Scrollback buffer(capacity);
+    size_t pos = 0;
+
+    bench("scrollback_write", sizeParams(capacity, chunk), chunk, [&]() {
+      buffer.write(data.data() + pos, chunk);
+      pos = (pos + chunk) % (data.size() - chunk);
+    });
+  }
+
+  Screen screen(50, 200);
+  size_t pos = 0;
+  bench("screen_feed", "{\"rows\": 50, \"cols\": 200, \"chunk\": " +
+    std::to_string(chunk) + "}", chunk, [&]() {
+    screen.feed(data.data() + pos, chunk);
+    pos = (pos + chunk) % (data.size() - chunk);
+  });
+}
+
+/* What attaching to or switching to a window costs: the last screenful of
+   lines copied back out of the scrollback, and a full repaint of its screen */
+void benchReplay(const std::string &data)
+{
+  const int rows = 50;
+  const int cols = 200;
+
+  Scrollback buffer(16 * MIB);
+  buffer.write(data.data(), data.size());
+  std::vector<char> into(data.size());
+
+  for (size_t lines : {50UL, 1000UL}) {
+    uint64_t from = buffer.lastLines(lines);
+    uint64_t len = buffer.tail() - from;
+    bench("scrollback_replay", "{\"lines\": " + std::to_string(lines) + "}",
+      len, [&]() {
+        buffer.read(from, &into[0], len);
+      });
+  }
+
+  Screen screen(rows, cols);
+  screen.feed(data.data(), data.size());
+  Renderer renderer;
+  bench("render_full_repaint", "{\"rows\": 50, \"cols\": 200}", 0, [&]() {
+    renderer.invalidate();
+    renderer.render(screen);
+  });
+}
+
+/* processInput() on a chunk of keystrokes for a window whose fdm is
+   /dev/null, with a prefix and an unbound command key every density bytes
+   (0 for none) */
+void benchInputScan()
+{
+  const size_t chunk = 4 * KIB;
+
+  int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (devNull == -1) {
+    sysError("open");
+  }
+
+  windows.push_back(std::unique_ptr<Window>(new Window(0, HOT_CAPACITY, "",
+    24, 80)));
+  Window &window = *windows.back();
+  if (dup2(devNull, window.fdm) == -1) {
+    sysError("dup2");
+  }
+  close(devNull);
+
+  NullTerminal term(24, 80);
+  attachTerminal(&term);
+
+  for (size_t density : {0UL, 1 * KIB, 64UL}) {
+    std::string input(chunk, 'a');
+    for (size_t i=density; density && i+1<chunk; i+=density) {
+      input[i - 1] = KEY_CTRL_A;
+      input[i] = 'x';
+    }
+
+    bench("input_scan", "{\"chunk\": " + std::to_string(chunk) +
+      ", \"prefix_every\": " + std::to_string(density) + "}", chunk, [&]() {
+        processInput(input.data(), input.size());
+      });
+  }
+
+  detachTerminal(&term);
+  windows.clear();
+}
+
+/* Starting a window's process with heap bytes of the session's memory
+   touched, which a fork() would have to copy the page tables of */
+void benchSpawn()
+{
+  int fdm = makePTY();
+  if (fdm == -1) {
+    sysError("makePTY");
+  }
+  SpawnSpec spec({"/bin/true"});
+
+  for (size_t heap : {0UL, 256 * MIB, 1024 * MIB}) {
+    std::vector<char> ballast(heap, 1);
+    bench("spawn_window", "{\"heap\": " + std::to_string(heap) + "}", 0,
+      [&]() {
+        pid_t pid = spawnOnPTY(fdm, spec);
+        if (pid == -1) {
+          sysError("spawnOnPTY");
+        }
+        waitpid(pid, NULL, 0);
+      });
+  }
+
+  close(fdm);
+}
+
+void printResults()
+{
+  printf("{\"benchmarks\": [\n");
+  for (size_t i=0; i<results.size(); ++i) {
+    const Result &res = results[i];
+    double mbPerSec = res.bytes ? res.bytes / res.nsPerOp * 1e9 / MIB : 0;
+    printf("  {\"name\": \"%s\", \"params\": %s, \"iterations\": %llu, "
+      "\"ns_per_op\": %.2f, \"mib_per_s\": %.2f}%s\n", res.name.c_str(),
+      res.params.c_str(), (unsigned long long) res.ops, res.nsPerOp, mbPerSec,
+      i + 1 < results.size() ? "," : "");
+  }
+  printf("]}\n");
+}
+
+/* Progress goes to stderr and the JSON results to stdout, e.g.
+   ./bench.out > before.json */
+int main()
+{
+  try {
+    std::string data = sampleOutput(4 * MIB);
+    benchRingBuffer(data);
+    benchSharedRing(data);
+    benchCompress(data);
+    benchOutputPath(data);
+    benchReplay(data);
+    benchInputScan();
+    benchSpawn();
+  } catch (const std::exception &ex) {
+    fprintf(stderr, "%s\n", ex.what());
+    return EXIT_FAILURE;
+  }
+
+  printResults();
+}
@@ -0,0 +1,515 @@
+#include "menu.h"
+#include "outputstage.h"
+#include "poller.h"
+#include "protocol.h"
+#include "sharedring.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <string>
+#include <memory>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+/* Stdin and the held fdm are read in chunks of up to this size */
+const size_t STDIN_CHUNK = 4096;
+const size_t PTY_CHUNK = 4096;
+const int MAX_EVENTS = 8;
+
+/* How long to wait for a freshly started daemon to listen */
+const int CONNECT_ATTEMPTS = 100;
+const useconds_t CONNECT_INTERVAL_US = 20000;
+
+/* The daemon's socket, and the window whose fdm it handed us (-1 for none)
+
+   Keystrokes go straight to the held fdm and its output straight to stdout,
+   so typing in a window costs what it would on a bare PTY. The output is
+   also copied to the daemon for the window's scrollback and screen
+
+   Input from a prefix onwards goes to the daemon instead. Each HELLO and
+   INPUT is answered by one FOREGROUND, and the fdm is left alone while any
+   are outstanding, since the command may hand the window back. The daemon
+   also takes it back (RECLAIM) once another client attaches
+
+   Everything for the terminal goes through output, and while that is over its
+   high-water mark neither the fdm nor the socket is read, which leaves the
+   daemon to skip frames and drain the window meanwhile */
+int sock = -1;
+int held = -1;
+int heldWID = -1;
+int outstanding = 0;
+Poller poller;
+std::unique_ptr<OutputStage> output;
+bool outputFull = false;
+bool watchingStdout = false;
+
+bool connectTo(const std::string &path)
+{
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  path.copy(addr.sun_path, path.size());
+
+  sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    sysError("socket");
+  }
+
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(sock);
+    sock = -1;
+    return false;
+  }
+  return true;
+}
+
+/* daemon.out is expected next to this executable. It daemonizes, so the child
+   returns as soon as the daemon is on its own */
+void startDaemon()
+{
+  char exe[4096];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len == -1) {
+    sysError("readlink");
+  }
+  exe[len] = '\0';
+  std::string path = std::string(dirname(exe)) + "/daemon.out";
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    sysError("fork");
+  } else if (pid == 0) {
+    execl(path.c_str(), "daemon.out", NULL);
+    _exit(EXIT_FAILURE);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+/* Attach to the session, starting its daemon if there isn't one */
+void connectToDaemon()
+{
+  std::string path = socketPath();
+  if (connectTo(path)) {
+    return;
+  }
+
+  startDaemon();
+  for (int i=0; i<CONNECT_ATTEMPTS; ++i) {
+    if (connectTo(path)) {
+      return;
+    }
+    usleep(CONNECT_INTERVAL_US);
+  }
+  throw std::runtime_error("Could not connect to " + path);
+}
+
+void send(uint8_t type, int32_t arg, const char *buf, size_t len)
+{
+  if (!sendMessage(sock, type, arg, buf, len)) {
+    sysError("sendmsg");
+  }
+}
+
+/* Only read the held fdm while it is ours to read and the terminal isn't
+   behind */
+void updateHeld()
+{
+  poller.remove(held);
+  if (held != -1 && !outstanding && !outputFull) {
+    poller.add(held);
+  }
+}
+
+/* Write out what the terminal takes now, waiting for stdout to be writable
+   while anything is left */
+void flushOutput()
+{
+  bool done = output->flush();
+
+  if (!done && !watchingStdout) {
+    poller.add(STDOUT_FILENO, EPOLLOUT);
+  } else if (done && watchingStdout) {
+    poller.remove(STDOUT_FILENO);
+  }
+  watchingStdout = !done;
+
+  if (outputFull != output->full()) {
+    outputFull = output->full();
+    if (outputFull) {
+      poller.remove(sock);
+    } else {
+      poller.add(sock);
+    }
+    updateHeld();
+  }
+}
+
+void writeOutput(const char *buf, size_t len)
+{
+  output->send(buf, len);
+  flushOutput();
+}
+
+void sendInput(const char *buf, size_t len)
+{
+  send(MSG_INPUT, 0, buf, len);
+  ++outstanding;
+  updateHeld();
+}
+
+void dropHeld()
+{
+  if (held != -1) {
+    poller.remove(held);
+    close(held);
+    held = -1;
+  }
+}
+
+/* Return whether to stay attached or not (error or EOF) */
+bool handleStdinRead()
+{
+  char buf[STDIN_CHUNK];
+  int res;
+  {
+    TraceSpan span(TRACE_STDIN_READ, heldWID);
+    res = span.len = read(STDIN_FILENO, buf, sizeof(buf));
+  }
+
+  if (res == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  } else if (res == -1) {
+    sysError("read");
+  } else if (res == 0) {
+    return false;
+  }
+
+  if (held == -1 || outstanding) {
+    sendInput(buf, res);
+    return true;
+  }
+
+  const char *prefix = (const char *) memchr(buf, KEY_CTRL_A, res);
+  size_t plain = prefix ? prefix - buf : res;
+  size_t written = 0;
+
+  /* The fdm is non-blocking, and whatever the window isn't ready for goes to
+     the daemon to queue, rather than holding up its output here */
+  while (written < plain) {
+    TraceSpan span(TRACE_PTY_WRITE, heldWID);
+    ssize_t len = write(held, buf + written, plain - written);
+    span.len = len;
+    if (len == -1 && errno == EINTR) {
+      continue;
+    } else if (len == -1 && (errno == EAGAIN || errno == EIO)) {
+      break;
+    } else if (len == -1) {
+      sysError("write");
+    }
+    written += len;
+  }
+
+  if (written < (size_t) res) {
+    sendInput(buf + written, res - written);
+  }
+
+  return true;
+}
+
+/* The held window's output is shown as is, and copied to the daemon. Once it
+   reads EOF, the daemon gets the fdm back to find out for itself, unless it
+   has reaped the window's child already, and perhaps exited with its last
+   window, in which case the socket reads EOF next */
+void handleHeldRead()
+{
+  char buf[PTY_CHUNK];
+  int res;
+  {
+    TraceSpan span(TRACE_PTY_READ, heldWID);
+    res = span.len = read(held, buf, sizeof(buf));
+  }
+
+  if (res == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  } else if (res > 0) {
+    writeOutput(buf, res);
+    send(MSG_OUTPUT, heldWID, buf, res);
+    return;
+  }
+
+  sendMessage(sock, MSG_RELEASE, heldWID, nullptr, 0);
+  dropHeld();
+}
+
+/* Return whether to stay attached or not. A daemon which exits, e.g. as its
+   last window closes, before reading what was sent to it (like the RELEASE
+   of a held window) resets the connection rather than closing it */
+bool handleMessage()
+{
+  MessageHeader header;
+  std::string payload;
+  int fd;
+
+  ssize_t res = recvMessage(sock, header, payload, fd);
+  if (res == -1 && errno != ECONNRESET) {
+    sysError("recvmsg");
+  } else if (res <= 0) {
+    return false;
+  }
+
+  switch (header.type) {
+  case MSG_FRAME: {
+    writeOutput(payload.data(), payload.size());
+    break;
+  }
+  case MSG_FOREGROUND: {
+    if (fd != -1 || header.arg == -1) {
+      dropHeld();
+      held = fd;
+      heldWID = header.arg;
+      traceInstant(TRACE_WINDOW_SWITCH, heldWID);
+    }
+    if (outstanding) {
+      --outstanding;
+    }
+    updateHeld();
+    break;
+  }
+  case MSG_RECLAIM: {
+    if (header.arg == heldWID) {
+      dropHeld();
+      heldWID = -1;
+    }
+    break;
+  }
+  case MSG_DETACH: {
+    return false;
+  }
+  default:
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  return true;
+}
+
+void runClient()
+{
+  if (!isatty(STDIN_FILENO)) {
+    throw std::runtime_error("Stdin must be connected to a terminal.");
+  }
+
+  connectToDaemon();
+
+  if (!setTerminalRawio()) {
+    sysError("set_rawio");
+  }
+
+  int rows, cols;
+  terminalSize(rows, cols);
+  send(MSG_HELLO, rows << 16 | cols, nullptr, 0);
+  ++outstanding;
+
+  output.reset(new OutputStage(STDOUT_FILENO));
+  poller.add(STDIN_FILENO);
+  poller.add(sock);
+
+  struct epoll_event events[MAX_EVENTS];
+  bool cont = true;
+
+  while (cont) {
+    int n;
+    {
+      TraceSpan span(TRACE_POLL_WAIT);
+      n = span.len = poller.wait(events, MAX_EVENTS);
+    }
+
+    for (int i=0; cont && i<n; ++i) {
+      int fd = events[i].data.fd;
+
+      if (fd == STDIN_FILENO) {
+        cont = handleStdinRead();
+      } else if (fd == STDOUT_FILENO) {
+        flushOutput();
+      } else if (fd == sock) {
+        cont = handleMessage();
+      } else if (fd == held && !outstanding) {
+        /* The fdm may have been swapped earlier in this batch */
+        handleHeldRead();
+      }
+    }
+  }
+
+  output->send(RESET FROM_ALT_BUF, strlen(RESET FROM_ALT_BUF));
+  output.reset();
+
+  if (tracing && !traceDump(traceFile())) {
+    sysError("traceDump");
+  }
+}
+
+/* Print a window's retained scrollback, read straight out of the daemon's
+   memory, without attaching. It keeps appending meanwhile, and the copy is of
+   one instant */
+void printHistory(int WID)
+{
+  connectToDaemon();
+  send(MSG_HISTORY, WID, nullptr, 0);
+
+  MessageHeader header;
+  std::string payload;
+  int fd;
+
+  ssize_t res = recvMessage(sock, header, payload, fd);
+  if (res == -1) {
+    sysError("recvmsg");
+  } else if (res == 0 || header.type != MSG_HISTORY) {
+    throw std::runtime_error("Unexpected reply from daemon");
+  } else if (fd == -1) {
+    throw std::runtime_error("No window " + std::to_string(WID));
+  }
+
+  SharedRingView view(fd);
+  close(fd);
+
+  std::string history;
+  uint64_t from = 0;
+  if (!view.snapshot(history, from)) {
+    throw std::runtime_error("Window " + std::to_string(WID) +
+      "'s scrollback is stuck mid-write: " + strError(errno));
+  }
+  if (writeAll(STDOUT_FILENO, history.data(), history.size()) == -1) {
+    sysError("write");
+  }
+}
+
+/* Print the daemon's per-window counters as JSON, e.g. for a monitoring
+   scraper */
+void printStats()
+{
+  connectToDaemon();
+  send(MSG_STATS, 0, nullptr, 0);
+
+  std::string json;
+  MessageHeader header;
+  header.arg = 1;
+
+  while (header.arg) {
+    std::string payload;
+    int fd;
+
+    ssize_t res = recvMessage(sock, header, payload, fd);
+    if (res == -1) {
+      sysError("recvmsg");
+    } else if (res == 0 || header.type != MSG_STATS) {
+      throw std::runtime_error("Unexpected reply from daemon");
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    json += payload;
+  }
+
+  json += '\n';
+  if (writeAll(STDOUT_FILENO, json.data(), json.size()) == -1) {
+    sysError("write");
+  }
+}
+
+/* Control the daemon's tracer, printing where a dump went */
+void controlTrace(const std::string &command)
+{
+  int arg = command == "start" ? 1 : command == "stop" ? 0 : -1;
+  connectToDaemon();
+  send(MSG_TRACE, arg, nullptr, 0);
+
+  MessageHeader header;
+  std::string payload;
+  int fd;
+
+  ssize_t res = recvMessage(sock, header, payload, fd);
+  if (res == -1) {
+    sysError("recvmsg");
+  } else if (res == 0 || header.type != MSG_TRACE) {
+    throw std::runtime_error("Unexpected reply from daemon");
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+
+  if (arg == -1 && payload.empty()) {
+    throw std::runtime_error("The daemon could not write its trace");
+  } else if (arg == -1) {
+    printf("%s\n", payload.c_str());
+  }
+}
+
+void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-p window ID, -1 for the current one] "
+    "[-j print window stats as JSON] "
+    "[-t start, stop or dump the daemon's trace] "
+    "[-T trace this client, dumping to this file on exit]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  bool history = false;
+  bool stats = false;
+  std::string traceCommand;
+  int WID = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:jt:T:")) != -1) {
+    if (opt == 'p') {
+      history = true;
+      WID = atoi(optarg);
+    } else if (opt == 'j') {
+      stats = true;
+    } else if (opt == 't') {
+      traceCommand = optarg;
+    } else if (opt == 'T') {
+      tracePath = optarg;
+      startTracing();
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc || (!traceCommand.empty() && traceCommand != "start" &&
+      traceCommand != "stop" && traceCommand != "dump")) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    if (history) {
+      printHistory(WID);
+    } else if (stats) {
+      printStats();
+    } else if (!traceCommand.empty()) {
+      controlTrace(traceCommand);
+    } else {
+      runClient();
+    }
+  } catch (const std::exception &ex) {
+    fprintf(stderr, "%s\r\n", ex.what());
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef COLDSTORE_H
+#define COLDSTORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Where a Scrollback keeps the last capacity bytes of a window's output when
+   only the most recent ones stay in plain memory, e.g. spilled to disk
+   (SegmentLog) or compressed (CompressedLog)
+
+   Offsets are absolute. Every byte is appended as it arrives, and head() moves
+   up as old ones are discarded. span() points at a run of retained bytes,
+   which may have to be paged in or decompressed first, valid until the next
+   call or append()
+
+   memoryBytes() is what the store holds in memory rather than on disk, and
+   shed() gives up at least the given amount of it if it can, discarding the
+   oldest bytes. It returns how much was freed */
+class ColdStore {
+public:
+  virtual ~ColdStore() {}
+
+  virtual void append(const char *from, size_t len) = 0;
+
+  virtual uint64_t head() const = 0;
+  virtual uint64_t tail() const = 0;
+  virtual size_t span(uint64_t from, const char **ptr) const = 0;
+
+  /* Bytes of memory or disk taken up by what is retained */
+  virtual size_t storedBytes() const = 0;
+  virtual size_t memoryBytes() const = 0;
+  virtual size_t shed(size_t bytes) = 0;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "compressedlog.h"
+#include "lz.h"
+
+#include <algorithm>
+
+
+/* Blocks are compressed as a whole, so one can't refer back further than
+   LZ_MAX_OFFSET */
+CompressedLog::CompressedLog(size_t capacity, size_t blockSize):
+  _capacity(capacity),
+  _blockSize(std::min(blockSize, LZ_MAX_OFFSET + 1)),
+  _stored(0),
+  _head(0),
+  _tail(0),
+  _cacheStart(UINT64_MAX)
+{}
+
+/* Bytes which would fall behind capacity straight away are skipped */
+void CompressedLog::append(const char *from, size_t len)
+{
+  if (len > _capacity) {
+    clear();
+    _tail += len - _capacity;
+    from += len - _capacity;
+    len = _capacity;
+  }
+
+  while (len) {
+    size_t blockLen = std::min(len, _blockSize - _open.size());
+    _open.append(from, blockLen);
+    from += blockLen;
+    len -= blockLen;
+    _tail += blockLen;
+
+    if (_open.size() == _blockSize) {
+      sealBlock();
+    }
+  }
+
+  _head = std::max(_head, _tail > _capacity ? _tail - _capacity : 0);
+  while (!_blocks.empty() && _blocks.front().start + _blockSize <= _head) {
+    _stored -= _blocks.front().data.size();
+    _blocks.pop_front();
+  }
+}
+
+uint64_t CompressedLog::head() const
+{
+  return _head;
+}
+
+uint64_t CompressedLog::tail() const
+{
+  return _tail;
+}
+
+/* Point ptr at the byte at absolute offset from, returning how many bytes
+   follow it contiguously (up to the end of its block), or 0 if it isn't
+   retained */
+size_t CompressedLog::span(uint64_t from, const char **ptr) const
+{
+  if (from < _head || from >= _tail) {
+    return 0;
+  }
+
+  uint64_t openStart = _tail - _open.size();
+  if (from >= openStart) {
+    *ptr = _open.data() + (from - openStart);
+    return _tail - from;
+  }
+
+  const Block &block =
+    _blocks[(from - _blocks.front().start) / _blockSize];
+  const std::string *data = &block.data;
+
+  if (block.compressed) {
+    if (_cacheStart != block.start) {
+      _cache.resize(_blockSize);
+      ssize_t len = lzDecompress(block.data.data(), block.data.size(),
+        &_cache[0], _cache.size());
+      if (len != (ssize_t) _blockSize) {
+        _cacheStart = UINT64_MAX;
+        return 0;
+      }
+      _cacheStart = block.start;
+    }
+    data = &_cache;
+  }
+
+  size_t pos = from - block.start;
+  *ptr = data->data() + pos;
+  return _blockSize - pos;
+}
+
+/* Compressed blocks plus the one being filled */
+size_t CompressedLog::storedBytes() const
+{
+  return _stored + _open.capacity();
+}
+
+/* Also counts the decompression cache */
+size_t CompressedLog::memoryBytes() const
+{
+  return _stored + _open.capacity() + _cache.capacity();
+}
+
+/* The cache goes first, then the oldest blocks. The open block stays */
+size_t CompressedLog::shed(size_t bytes)
+{
+  size_t freed = _cache.capacity();
+  std::string().swap(_cache);
+  _cacheStart = UINT64_MAX;
+
+  while (freed < bytes && !_blocks.empty()) {
+    const Block &block = _blocks.front();
+    freed += block.data.size();
+    _stored -= block.data.size();
+    _head = std::max(_head, block.start + _blockSize);
+    _blocks.pop_front();
+  }
+
+  return freed;
+}
+
+void CompressedLog::sealBlock()
+{
+  Block block;
+  block.start = _tail - _open.size();
+  block.data.resize(lzBound(_open.size()));
+
+  size_t len = lzCompress(_open.data(), _open.size(), &block.data[0],
+    block.data.size());
+  block.compressed = len < _open.size();
+  if (block.compressed) {
+    block.data.resize(len);
+    block.data.shrink_to_fit();
+  } else {
+    block.data = _open;
+  }
+
+  _stored += block.data.size();
+  _blocks.push_back(std::move(block));
+  _open.clear();
+}
+
+void CompressedLog::clear()
+{
+  _blocks.clear();
+  _stored = 0;
+  _open.clear();
+  _cacheStart = UINT64_MAX;
+  _head = _tail;
+}
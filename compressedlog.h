@@ -0,0 +1,60 @@
+#ifndef COMPRESSEDLOG_H
+#define COMPRESSEDLOG_H
+
+#include "coldstore.h"
+
+#include <deque>
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Default amount of output compressed as one unit */
+const size_t BLOCK_SIZE = 64 * 1024;
+
+/* The last capacity bytes of a stream, kept in memory in fixed-size blocks
+   which are compressed with the LZ codec as they fill up
+
+   Terminal output (build logs, listings) is repetitive enough that this holds
+   several times the history per byte of memory. A block is only decompressed
+   when read, into a one-block cache, since reads tend to be sequential. A
+   block which doesn't shrink is kept as is */
+class CompressedLog : public ColdStore {
+public:
+  CompressedLog(size_t capacity, size_t blockSize=BLOCK_SIZE);
+
+  void append(const char *from, size_t len) override;
+
+  uint64_t head() const override;
+  uint64_t tail() const override;
+  size_t span(uint64_t from, const char **ptr) const override;
+  size_t storedBytes() const override;
+  size_t memoryBytes() const override;
+  size_t shed(size_t bytes) override;
+
+private:
+  struct Block {
+    uint64_t start;
+    bool compressed;
+    std::string data;
+  };
+
+  void sealBlock();
+  void clear();
+
+  size_t _capacity;
+  size_t _blockSize;
+  std::deque<Block> _blocks;
+  size_t _stored;
+
+  /* The block being filled, uncompressed, which starts at _tail - size */
+  std::string _open;
+  uint64_t _head;
+  uint64_t _tail;
+
+  mutable uint64_t _cacheStart;
+  mutable std::string _cache;
+};
+
+#endif
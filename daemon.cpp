@@ -1,14 +1,27 @@
+#include "protocol.h"
+#include "session.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
 
 /* Return as orphan. Note parent calls exit() which does NOT stack unwind */
@@ -62,25 +75,549 @@ bool createFile(const std::string &path, mode_t mode, bool exclusive=true)
   return true;
 }
 
-/* Demonstrate a daemon */
-void demoDaemon()
+/* Messages to a client which couldn't be sent yet are queued up to this many
+   payload bytes, past which it is sent no more frames until it catches up */
+const size_t CLIENT_QUEUE_BYTES = 256 * 1024;
+
+/* A client connection, which when it is the only one attached is handed the
+   current window's fdm so that its I/O doesn't pass through the daemon
+
+   The fdm is only ever read by one side. While the client holds it, the
+   daemon stops watching it and learns of its output from OUTPUT messages
+   instead, so there is nothing to render. The client hands input containing
+   the prefix to the daemon and stops using the fdm until told which window to
+   use next (FOREGROUND), so commands take effect in order with plain input.
+   Once another client attaches, the fdm is taken back (RECLAIM), since every
+   client must then be sent frames
+
+   The socket is non-blocking, so a client on a slow link never holds up the
+   windows or the other clients. Whatever it can't take yet waits in its own
+   queue, in order, and while that is over CLIENT_QUEUE_BYTES its frames are
+   skipped, the next one after it drains covering all of them */
+class ClientTerminal : public Terminal {
+public:
+  ClientTerminal(int sock):
+    Terminal(24, 80),
+    sock(sock),
+    attached(false),
+    held(nullptr),
+    detaching(false),
+    _queued(0)
+  {}
+
+  ~ClientTerminal()
+  {
+    for (Message &message : _queue) {
+      if (message.fd != -1) {
+        close(message.fd);
+      }
+    }
+    close(sock);
+  }
+
+  /* Frames are split into messages, which the client writes out in order */
+  void send(const std::string &bytes) override
+  {
+    for (size_t i=0; i<bytes.size(); i+=MAX_PAYLOAD) {
+      size_t len = std::min(MAX_PAYLOAD, bytes.size() - i);
+      post(MSG_FRAME, 0, bytes.data() + i, len);
+    }
+  }
+
+  bool mirrorsWindow() const override
+  {
+    return held;
+  }
+
+  bool congested() const override
+  {
+    return _queued > CLIENT_QUEUE_BYTES;
+  }
+
+  void detach() override
+  {
+    detaching = true;
+  }
+
+  /* The client's terminal shows whatever the closed window wrote to it
+     directly, which the window's Screen may not model exactly, so the next
+     frame is a full repaint */
+  void windowClosed(const Window &window) override
+  {
+    if (held == &window) {
+      post(MSG_RECLAIM, window.WID, nullptr, 0);
+      held = nullptr;
+      renderer.invalidate();
+      requestFrame();
+    }
+  }
+
+  void post(uint8_t type, int32_t arg, const char *buf, size_t len,
+    int passFd=-1);
+  void flush();
+  void handoff(bool force);
+  void reclaim();
+  void release();
+
+  int sock;
+  bool attached;
+  Window *held;
+  bool detaching;
+
+private:
+  /* A queued message keeps its own copy of any descriptor passed with it */
+  struct Message {
+    uint8_t type;
+    int32_t arg;
+    std::string payload;
+    int fd;
+  };
+
+  std::deque<Message> _queue;
+  size_t _queued;
+};
+
+/* Every connection, by socket. Only attached ones (HELLO) are displayed on,
+   the others may just ask for history, stats or the trace */
+std::unordered_map<int, std::unique_ptr<ClientTerminal>> clients;
+int attachedCount = 0;
+
+/* Send a message now if nothing is queued ahead of it, otherwise queue it and
+   wait for the socket to be writable. A client which has gone is noticed
+   when its socket reads EOF */
+void ClientTerminal::post(uint8_t type, int32_t arg, const char *buf,
+  size_t len, int passFd)
+{
+  if (_queue.empty()) {
+    if (sendMessage(sock, type, arg, buf, len, passFd) || errno != EAGAIN) {
+      return;
+    }
+    poller->modify(sock, EPOLLIN | EPOLLOUT);
+  }
+
+  int fd = passFd != -1 ? fcntl(passFd, F_DUPFD_CLOEXEC, 0) : -1;
+  _queue.push_back({type, arg, std::string(buf, len), fd});
+  _queued += len;
+}
+
+/* Send what the socket will take, and once the queue is empty, stop waiting
+   for it. Catching up calls for a frame with everything skipped meanwhile */
+void ClientTerminal::flush()
+{
+  bool wasCongested = congested();
+
+  while (!_queue.empty()) {
+    Message &message = _queue.front();
+    if (!sendMessage(sock, message.type, message.arg, message.payload.data(),
+        message.payload.size(), message.fd) && errno == EAGAIN) {
+      break;
+    }
+    if (message.fd != -1) {
+      close(message.fd);
+    }
+    _queued -= message.payload.size();
+    _queue.pop_front();
+  }
+
+  if (_queue.empty()) {
+    poller->modify(sock, EPOLLIN);
+  }
+  if (wasCongested && !congested()) {
+    requestFrame();
+  }
+}
+
+/* Hand the client the current window, or take back the one it has while a
+   Menu or search is up or other clients are attached, replying with
+   FOREGROUND either way. A window with input still pending stays here until
+   it is written, so later keys can't overtake it. That includes the one the
+   client holds, whose writes fell short and were sent here to be queued:
+   it is taken back, so the daemon watches for it to be writable. A new
+   window starts with a full repaint, since the client's terminal shows
+   whatever it last wrote */
+void ClientTerminal::handoff(bool force)
 {
-  std::string path = "/Users/jacguo/Projects/screens/out.txt";
-  if (!createFile(path, 0644, false)) {
-    sysError("createFile");
+  Window *want = windows.empty() || overlayActive() || attachedCount > 1 ?
+    nullptr : &getWindow(currentWindow);
+  if (want && want->pendingInput.size()) {
+    want = nullptr;
+  }
+
+  if (want == held && !force) {
+    post(MSG_FOREGROUND, held ? held->WID : -1, nullptr, 0);
+    return;
   }
 
-  if (!daemonize(path)) {
-    sysError("daemonize");
+  release();
+  renderer.invalidate();
+  if (!want) {
+    post(MSG_FOREGROUND, -1, nullptr, 0);
+    return;
   }
-  printf("I'm a daemon!\n");
+
+  send(renderer.render(want->screen));
+  unwatchWindow(*want);
+  held = want;
+  post(MSG_FOREGROUND, held->WID, nullptr, 0, held->fdm);
+}
+
+/* Take back the window the client holds without it asking, and repaint it
+   from the daemon's side from now on */
+void ClientTerminal::reclaim()
+{
+  if (held) {
+    post(MSG_RECLAIM, held->WID, nullptr, 0);
+    release();
+    renderer.invalidate();
+    requestFrame();
+  }
+}
+
+/* Read the held window's fdm here again */
+void ClientTerminal::release()
+{
+  if (held) {
+    watchWindow(*held);
+    held = nullptr;
+  }
+}
+
+void disconnectClient(ClientTerminal &client)
+{
+  if (client.attached) {
+    client.release();
+    detachTerminal(&client);
+    --attachedCount;
+  }
+  unwatchFd(client.sock);
+  clients.erase(client.sock);
+}
+
+/* Share a window's scrollback for the client to map, rather than sending it.
+   An idle window's hot bytes are reloaded from its cold store first, and it
+   counts as active, so they aren't released again before the client reads
+   them */
+void sendHistory(ClientTerminal &client, int WID)
+{
+  Window *window = WID == -1 && !windows.empty() ?
+    &getWindow(currentWindow) : findWindow(WID);
+  if (window) {
+    window->buffer.reload();
+    window->lastActive = monotonicNs();
+  }
+  int fd = window ? window->buffer.shareFd() : -1;
+
+  client.post(MSG_HISTORY, window ? window->WID : WID, nullptr, 0, fd);
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+void sendStats(ClientTerminal &client)
+{
+  std::string json = statsJson();
+  size_t pos = 0;
+
+  do {
+    size_t len = std::min(json.size() - pos, MAX_PAYLOAD);
+    bool more = pos + len < json.size();
+    client.post(MSG_STATS, more, json.data() + pos, len);
+    pos += len;
+  } while (pos < json.size());
+}
+
+/* Start, stop (arg 1 or 0) or dump (arg -1) the daemon's trace, replying
+   with the dump's path, or nothing if it couldn't be written */
+void handleTrace(ClientTerminal &client, int arg)
+{
+  std::string path;
+  if (arg == 1) {
+    startTracing();
+  } else if (arg == 0) {
+    stopTracing();
+  } else if (traceDump(traceFile())) {
+    path = traceFile();
+  }
+  client.post(MSG_TRACE, tracing, path.data(), path.size());
+}
+
+/* Display on the client too. Whoever holds a window gives it back, since
+   frames now have to be rendered for more than one client */
+void attachClient(ClientTerminal &client, int32_t size)
+{
+  client.rows = (size >> 16) & 0xffff;
+  client.cols = size & 0xffff;
+  if (!client.attached) {
+    client.attached = true;
+    ++attachedCount;
+  }
+
+  for (auto &it : clients) {
+    if (it.second.get() != &client) {
+      it.second->reclaim();
+    }
+  }
+
+  /* With no window to show, e.g. because the command fails to start, the
+     client is sent away again */
+  attachTerminal(&client);
+  if (windows.empty() && !createWindow()) {
+    fprintf(stderr, "Could not start %s: %s\n", windowSpec.path.c_str(),
+      strError(errno).c_str());
+    client.post(MSG_DETACH, 0, nullptr, 0);
+    disconnectClient(client);
+    return;
+  }
+  client.handoff(true);
+}
+
+/* Return whether the session should continue or not */
+bool handleClientMessage(ClientTerminal &client)
+{
+  MessageHeader header;
+  std::string payload;
+  int fd;
+
+  ssize_t res = recvMessage(client.sock, header, payload, fd);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (res == -1 && errno == EAGAIN) {
+    return true;
+  } else if (res <= 0) {
+    disconnectClient(client);
+    return true;
+  }
+
+  if (header.type == MSG_HISTORY) {
+    sendHistory(client, header.arg);
+    return true;
+  } else if (header.type == MSG_STATS) {
+    sendStats(client);
+    return true;
+  } else if (header.type == MSG_TRACE) {
+    handleTrace(client, header.arg);
+    return true;
+  } else if (header.type == MSG_HELLO) {
+    attachClient(client, header.arg);
+    return true;
+  } else if (!client.attached) {
+    return true;
+  }
+
+  switch (header.type) {
+  case MSG_INPUT: {
+    traceInstant(TRACE_STDIN_READ, -1, payload.size());
+    focusTerminal(&client);
+    if (!processInput(payload.data(), payload.size())) {
+      return false;
+    }
+    if (client.detaching) {
+      client.post(MSG_DETACH, 0, nullptr, 0);
+      disconnectClient(client);
+      return true;
+    }
+    client.handoff(false);
+    break;
+  }
+  case MSG_OUTPUT: {
+    Window *window = findWindow(header.arg);
+    if (window) {
+      windowOutput(*window, payload.data(), payload.size());
+      window->stats.shown(payload.size(), window->lastActive);
+    }
+    break;
+  }
+  case MSG_RELEASE: {
+    if (client.held && client.held->WID == header.arg) {
+      client.release();
+    }
+    break;
+  }}
+
+  return true;
+}
+
+/* A client's queue drains when its socket is writable (EPOLLOUT), and a hang
+   up reads as EOF */
+bool handleClientEvents(ClientTerminal &client, uint32_t events)
+{
+  if (events & EPOLLOUT) {
+    client.flush();
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    return handleClientMessage(client);
+  }
+  return true;
+}
+
+/* Only the user's own processes may connect, whatever the socket's
+   permissions, since a client can type into every window */
+bool trustedPeer(int sock)
+{
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+    cred.uid == getuid();
+}
+
+bool handleAccept(int listener)
+{
+  int sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock == -1) {
+    return true;
+  } else if (!trustedPeer(sock)) {
+    close(sock);
+    return true;
+  }
+
+  ClientTerminal *client = new ClientTerminal(sock);
+  clients[sock].reset(client);
+  watchFd(sock, [client](uint32_t events) {
+    return handleClientEvents(*client, events);
+  });
+  return true;
+}
+
+/* Listen on path, unless another daemon already answers there. A socket file
+   left behind by one which died is replaced */
+int listenOn(const std::string &path)
+{
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  path.copy(addr.sun_path, path.size());
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    sysError("socket");
+  }
+
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+    close(sock);
+    throw std::runtime_error("A daemon is already listening on " + path);
+  }
+  unlink(path.c_str());
+
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      listen(sock, 4) == -1) {
+    close(sock);
+    sysError("bind");
+  }
+
+  return sock;
+}
+
+/* Own the windows of one session until its last window exits, with its
+   output logged next to the socket */
+void runDaemon(bool foreground)
+{
+  std::string path = socketPath();
+  std::string log = path + ".log";
+
+  /* Windows start where the daemon was started, rather than in / */
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd))) {
+    windowSpec.cwd = cwd;
+    if (!spillDir.empty() && spillDir[0] != '/') {
+      spillDir = windowSpec.cwd + "/" + spillDir;
+    }
+  }
+
+  if (!foreground) {
+    if (!createFile(log, 0600, false)) {
+      sysError("createFile");
+    }
+    if (!daemonize(log)) {
+      sysError("daemonize");
+    }
+  }
+
+  /* Every descriptor is closed while daemonizing, so the socket comes after */
+  int listener = listenOn(path);
+  poller.reset(new Poller());
+  watchFd(listener, [listener](uint32_t) {
+    return handleAccept(listener);
+  });
+
+  runSession();
+
+  if (tracing) {
+    traceDump(traceFile());
+  }
+  for (auto &it : clients) {
+    if (it.second->attached) {
+      sendMessage(it.second->sock, MSG_DETACH, 0, nullptr, 0);
+    }
+  }
+  unlink(path.c_str());
+}
+
+void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-f stay in the foreground] "
+    "[-r frames per second, 0 for no limit] "
+    "[-s scrollback bytes per window, e.g. 256M] "
+    "[-d directory to spill scrollback to, rather than compress it] "
+    "[-m scrollback memory for all windows, 0 for no limit] "
+    "[-t trace from the start, dumping to this file on exit] "
+    "[-w windows to keep started ahead of time, default 1] "
+    "[command [args...] for new windows, default /bin/bash]\n", name);
 }
 
 /* Note uncaught exceptions may not unwind the stack */
-int main()
+int main(int argc, char **argv)
 {
+  bool foreground = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+fr:s:d:m:t:w:")) != -1) {
+    if (opt == 'f') {
+      foreground = true;
+    } else if (opt == 'r') {
+      if (!parseCount(optarg, frameRate)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 'd') {
+      spillDir = optarg;
+    } else if (opt == 's') {
+      if (!parseSize(optarg, scrollbackCapacity) || !scrollbackCapacity) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 'm') {
+      if (!parseSize(optarg, scrollbackBudget)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 't') {
+      tracePath = optarg;
+      startTracing();
+    } else if (opt == 'w') {
+      if (!parseCount(optarg, poolSize)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    windowSpec = SpawnSpec(std::vector<std::string>(argv + optind,
+      argv + argc));
+  }
+
+  /* Wide characters are measured with wcwidth(), which needs the user's
+     locale rather than the C one */
+  setlocale(LC_CTYPE, "");
+
   try {
-    demoDaemon();
+    runDaemon(foreground);
   } catch (const std::exception &ex) {
     fprintf(stderr, "%s\n", ex.what());
     return EXIT_FAILURE;
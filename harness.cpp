@@ -0,0 +1,339 @@
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+
+
+/* Runs shell.out on a PTY, playing the user's terminal, and measures what the
+   user would notice: how long a keystroke takes to be echoed while other
+   windows flood output, and how fast a large cat gets through. Nothing needs
+   a display, so it runs on a headless CI box. Results are printed as JSON */
+
+const int ROWS = 24;
+const int COLS = 80;
+const size_t READ_CHUNK = 64 * 1024;
+
+/* How long output must pause before the screen counts as settled, and how
+   long to wait for anything at all */
+const int QUIET_MS = 200;
+const uint64_t ECHO_TIMEOUT_NS = 5ULL * 1000000000;
+const uint64_t CAT_TIMEOUT_NS = 300ULL * 1000000000;
+
+/* Typed one at a time, none of them appearing in the prompt, and the line is
+   cleared (^U) every LINE_KEYS keystrokes. Keys are spaced out like a fast
+   typist's by default, since ones arriving faster than the multiplexer's
+   frame rate are deliberately echoed together in the next frame */
+const char ECHO_KEYS[] = "qzjkxv";
+const int LINE_KEYS = 40;
+const int DEFAULT_KEY_GAP_MS = 20;
+
+/* The multiplexer's side of the PTY, and its process */
+int fdm = -1;
+pid_t child = -1;
+
+/* Everything received since the last call to clearSeen(), for spotting
+   strings split across reads */
+std::string seen;
+
+/* Start shell.out (from next to this executable) with args on a new PTY, in
+   a scratch HOME so no user configuration changes what is measured */
+void startShell(const std::vector<std::string> &args, const std::string &home)
+{
+  char exe[4096];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len == -1) {
+    sysError("readlink");
+  }
+  exe[len] = '\0';
+  std::string path = std::string(dirname(exe)) + "/shell.out";
+
+  if ((fdm = makePTY()) == -1) {
+    sysError("makePTY");
+  }
+  if (!setPTYSize(fdm, ROWS, COLS)) {
+    sysError("setPTYSize");
+  }
+
+  child = fork();
+  if (child == -1) {
+    sysError("fork");
+  } else if (child > 0) {
+    return;
+  }
+
+  int fds = -1;
+  const char *slave = ptsname(fdm);
+  if (setsid() == -1 || !slave || (fds = open(slave, O_RDWR)) == -1 ||
+      !resetStddes(fds)) {
+    _exit(EXIT_FAILURE);
+  }
+  close(fds);
+
+  setenv("HOME", home.c_str(), 1);
+  setenv("TERM", "xterm-256color", 1);
+  setenv("PS1", "$ ", 1);
+
+  std::vector<char *> argv;
+  argv.push_back((char *) "shell.out");
+  for (const std::string &arg : args) {
+    argv.push_back((char *) arg.c_str());
+  }
+  argv.push_back(nullptr);
+
+  execv(path.c_str(), argv.data());
+  _exit(EXIT_FAILURE);
+}
+
+void type(const std::string &keys)
+{
+  if (writeAll(fdm, keys.data(), keys.size()) == -1) {
+    sysError("write");
+  }
+}
+
+/* Read whatever output arrives within timeoutMs, returning whether any did */
+bool pump(int timeoutMs)
+{
+  struct pollfd pfd = {fdm, POLLIN, 0};
+  int res = poll(&pfd, 1, timeoutMs);
+  if (res == -1 && errno != EINTR) {
+    sysError("poll");
+  } else if (res <= 0) {
+    return false;
+  }
+
+  char buf[READ_CHUNK];
+  ssize_t len = read(fdm, buf, sizeof(buf));
+  if (len == -1 && errno == EINTR) {
+    return true;
+  } else if (len <= 0) {
+    throw std::runtime_error("shell.out exited");
+  }
+
+  seen.append(buf, len);
+  if (seen.size() > 2 * READ_CHUNK) {
+    seen.erase(0, seen.size() - READ_CHUNK);
+  }
+  return true;
+}
+
+void clearSeen()
+{
+  seen.clear();
+}
+
+/* Read until output stops for QUIET_MS */
+void settle()
+{
+  while (pump(QUIET_MS));
+}
+
+/* Read until needle has been output since the last clearSeen(), returning
+   when it arrived */
+uint64_t waitFor(const std::string &needle, uint64_t timeoutNs)
+{
+  uint64_t deadline = monotonicNs() + timeoutNs;
+
+  while (seen.find(needle) == std::string::npos) {
+    uint64_t now = monotonicNs();
+    if (now >= deadline) {
+      throw std::runtime_error("Timed out waiting for \"" + needle + "\"");
+    }
+    pump(std::max((uint64_t) 1, (deadline - now) / 1000000));
+  }
+
+  return monotonicNs();
+}
+
+/* Open count more windows, each running yes, and go back to the first. The
+   multiplexer has to drain them all at full speed meanwhile */
+void startBackgroundLoad(int count)
+{
+  for (int i=0; i<count; ++i) {
+    type("\x01" "c");
+    settle();
+    type("yes\r");
+    settle();
+  }
+  if (count) {
+    type("\x01" "n");
+  }
+  type("\x15");
+  settle();
+}
+
+/* Nanoseconds from each keystroke to its echo reaching the terminal, with
+   gapMs between an echo and the next keystroke */
+std::vector<uint64_t> measureEcho(int keystrokes, int gapMs)
+{
+  std::vector<uint64_t> samples;
+
+  for (int i=0; i<keystrokes; ++i) {
+    if (i && !(i % LINE_KEYS)) {
+      type("\x15");
+      settle();
+    }
+
+    uint64_t next = monotonicNs() + gapMs * 1000000ULL;
+    for (uint64_t now; (now = monotonicNs()) < next; ) {
+      pump((next - now) / 1000000 + 1);
+    }
+    while (pump(0));
+    clearSeen();
+
+    std::string key(1, ECHO_KEYS[i % (sizeof(ECHO_KEYS) - 1)]);
+    uint64_t start = monotonicNs();
+    type(key);
+    samples.push_back(waitFor(key, ECHO_TIMEOUT_NS) - start);
+  }
+
+  type("\x15");
+  settle();
+  std::sort(samples.begin(), samples.end());
+  return samples;
+}
+
+/* A file of size bytes of log-like lines */
+std::string makeCatFile(const std::string &dir, size_t size)
+{
+  std::string path = dir + "/cat.txt";
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) {
+    sysError("fopen");
+  }
+
+  size_t written = 0;
+  for (uint64_t line=0; written<size; ++line) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf),
+      "%012llu the quick brown fox jumps over the lazy dog %08llx\n",
+      (unsigned long long) line, (unsigned long long) (line * 2654435761U));
+    fwrite(buf, 1, len, file);
+    written += len;
+  }
+
+  if (fclose(file) == -1) {
+    sysError("fclose");
+  }
+  return path;
+}
+
+/* Seconds for cat to get through the file, timed to the marker it echoes
+   afterwards, which the command line itself doesn't contain */
+double measureCat(const std::string &path)
+{
+  settle();
+  clearSeen();
+
+  uint64_t start = monotonicNs();
+  type("cat " + path + "; echo CAT_$((6*7))_DONE\r");
+  uint64_t end = waitFor("CAT_42_DONE", CAT_TIMEOUT_NS);
+  return (end - start) / 1e9;
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+  return sorted[i] / 1e3;
+}
+
+void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-n background windows] [-k keystrokes] "
+    "[-i ms between keystrokes] [-c MiB to cat] "
+    "[-- shell.out options, e.g. -r 0]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  int background = 4;
+  int keystrokes = 1000;
+  int gapMs = DEFAULT_KEY_GAP_MS;
+  size_t catSize = 64 * 1024 * 1024;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:k:i:c:")) != -1) {
+    if (opt == 'n') {
+      background = atoi(optarg);
+    } else if (opt == 'k') {
+      keystrokes = atoi(optarg);
+    } else if (opt == 'i') {
+      gapMs = atoi(optarg);
+    } else if (opt == 'c') {
+      catSize = (size_t) atoi(optarg) * 1024 * 1024;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (background < 0 || keystrokes <= 0 || gapMs < 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> shellArgs(argv + optind, argv + argc);
+
+  char dir[] = "/tmp/screens-harness-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  std::string catPath;
+  try {
+    catPath = makeCatFile(dir, catSize);
+    startShell(shellArgs, dir);
+    settle();
+
+    startBackgroundLoad(background);
+    fprintf(stderr, "Measuring echo latency with %d busy windows\n",
+      background);
+    std::vector<uint64_t> echo = measureEcho(keystrokes, gapMs);
+
+    /* The cat runs with the same load behind it */
+    fprintf(stderr, "Measuring cat throughput\n");
+    double seconds = measureCat(catPath);
+
+    printf("{\"echo_latency_us\": {\"samples\": %zu, "
+      "\"background_windows\": %d, \"gap_ms\": %d, \"p50\": %.1f, "
+      "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n", echo.size(),
+      background, gapMs,
+      percentile(echo, 0.5), percentile(echo, 0.99), percentile(echo, 0.999),
+      echo.back() / 1e3);
+    printf(" \"cat_throughput\": {\"bytes\": %zu, \"seconds\": %.3f, "
+      "\"mib_per_s\": %.1f}}\n", catSize, seconds,
+      catSize / seconds / (1024 * 1024));
+  } catch (const std::exception &ex) {
+    fprintf(stderr, "%s\n", ex.what());
+    status = EXIT_FAILURE;
+  }
+
+  if (child > 0) {
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+  }
+  if (!catPath.empty()) {
+    unlink(catPath.c_str());
+  }
+  rmdir(dir);
+  return status;
+}
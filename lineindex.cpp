@@ -0,0 +1,65 @@
+#include "lineindex.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+
+/* Record the line starts within len bytes which begin at absolute offset pos */
+void LineIndex::append(uint64_t pos, const char *from, size_t len)
+{
+  const char *end = from + len;
+  const char *cur = from;
+
+  while ((cur = (const char *) memchr(cur, '\n', end - cur))) {
+    ++cur;
+    _starts.push_back(pos + (cur - from));
+  }
+}
+
+/* Forget line starts before head, i.e. those whose bytes were overwritten */
+void LineIndex::trim(uint64_t head)
+{
+  while (!_starts.empty() && _starts.front() < head) {
+    _starts.pop_front();
+  }
+}
+
+void LineIndex::clear()
+{
+  _starts.clear();
+}
+
+size_t LineIndex::lines() const
+{
+  return _starts.size();
+}
+
+/* Offset of the k-th oldest full line, where k must be less than lines() */
+uint64_t LineIndex::lineStart(size_t k) const
+{
+  return _starts.at(k);
+}
+
+/* How many full lines start at or before pos, so pos is on line k - 1 if that
+   is k, or on the partial first line if there are none */
+size_t LineIndex::lineAt(uint64_t pos) const
+{
+  return std::upper_bound(_starts.begin(), _starts.end(), pos) -
+    _starts.begin();
+}
+
+/* Offset from which the last n lines (counting the one in progress) can be
+   replayed. Asking for more lines than are indexed gives the first full line,
+   or head if no newline has been retained at all */
+uint64_t LineIndex::lastLines(size_t n, uint64_t head, uint64_t tail) const
+{
+  if (!n) {
+    return tail;
+  } else if (_starts.empty()) {
+    return head;
+  } else if (n >= _starts.size()) {
+    return _starts.front();
+  }
+  return _starts[_starts.size() - n];
+}
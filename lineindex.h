@@ -0,0 +1,32 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <deque>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Absolute offsets of the line starts (the byte after each newline) within a
+   stream of output, oldest first
+
+   Offsets count every byte ever appended, so they stay valid while the
+   underlying buffer wraps. New output is scanned once as it arrives, and
+   entries which fall behind the oldest retained byte are trimmed from the
+   front, so lookups by line number are O(1) however large the buffer is */
+class LineIndex {
+public:
+  void append(uint64_t pos, const char *from, size_t len);
+  void trim(uint64_t head);
+  void clear();
+
+  size_t lines() const;
+  uint64_t lineStart(size_t k) const;
+  size_t lineAt(uint64_t pos) const;
+  uint64_t lastLines(size_t n, uint64_t head, uint64_t tail) const;
+
+private:
+  std::deque<uint64_t> _starts;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+const size_t MIN_MATCH = 4;
+const int HASH_BITS = 14;
+
+/* Matches stop this far from the end, so that the last sequence has some
+   literals and the 4-byte loads stay in bounds */
+const size_t END_LITERALS = 5;
+
+uint32_t load32(const unsigned char *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t hash32(uint32_t value)
+{
+  return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* A length nibble of 15 is followed by bytes of 255 and a final smaller one */
+unsigned char *putLength(unsigned char *op, size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+unsigned char *putSequence(unsigned char *op, const unsigned char *literals,
+  size_t literalLen, size_t offset, size_t matchLen)
+{
+  unsigned char *token = op++;
+  *token = (literalLen < 15 ? literalLen : 15) << 4;
+  if (literalLen >= 15) {
+    op = putLength(op, literalLen - 15);
+  }
+  memcpy(op, literals, literalLen);
+  op += literalLen;
+
+  if (!matchLen) {
+    return op;
+  }
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  matchLen -= MIN_MATCH;
+  *token |= matchLen < 15 ? matchLen : 15;
+  if (matchLen >= 15) {
+    op = putLength(op, matchLen - 15);
+  }
+  return op;
+}
+
+/* The most lzCompress() can write for len bytes, i.e. all literals */
+size_t lzBound(size_t len)
+{
+  return len + len / 255 + 16;
+}
+
+/* Returns the compressed length, or 0 if dstLen is less than lzBound(len).
+   Literal runs speed up the search as they grow, so incompressible input
+   passes through quickly */
+size_t lzCompress(const char *src, size_t len, char *dst, size_t dstLen)
+{
+  if (dstLen < lzBound(len)) {
+    return 0;
+  }
+
+  const unsigned char *base = (const unsigned char *) src;
+  const unsigned char *ip = base;
+  const unsigned char *anchor = base;
+  const unsigned char *end = base + len;
+  const unsigned char *matchLimit = len > END_LITERALS ?
+    end - END_LITERALS : base;
+  unsigned char *op = (unsigned char *) dst;
+
+  uint32_t table[1 << HASH_BITS] = {};
+
+  while (ip + MIN_MATCH <= matchLimit) {
+    uint32_t seq = load32(ip);
+    uint32_t h = hash32(seq);
+    const unsigned char *ref = base + table[h];
+    table[h] = ip - base;
+
+    if (ref >= ip || (size_t) (ip - ref) > LZ_MAX_OFFSET ||
+        load32(ref) != seq) {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    /* Extend backwards over literals, then forwards */
+    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+      --ip;
+      --ref;
+    }
+    size_t matchLen = MIN_MATCH;
+    while (ip + matchLen < matchLimit && ip[matchLen] == ref[matchLen]) {
+      ++matchLen;
+    }
+
+    op = putSequence(op, anchor, ip - anchor, ip - ref, matchLen);
+    ip += matchLen;
+    anchor = ip;
+  }
+
+  op = putSequence(op, anchor, end - anchor, 0, 0);
+  return op - (unsigned char *) dst;
+}
+
+/* Returns the decompressed length, or -1 if src is malformed or wouldn't fit
+   in dstLen. Every read and write is bounds-checked */
+ssize_t lzDecompress(const char *src, size_t len, char *dst, size_t dstLen)
+{
+  const unsigned char *ip = (const unsigned char *) src;
+  const unsigned char *end = ip + len;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *opEnd = op + dstLen;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+
+    size_t literalLen = token >> 4;
+    if (literalLen == 15) {
+      unsigned char c;
+      do {
+        if (ip == end) {
+          return -1;
+        }
+        c = *ip++;
+        literalLen += c;
+      } while (c == 255);
+    }
+    if ((size_t) (end - ip) < literalLen ||
+        (size_t) (opEnd - op) < literalLen) {
+      return -1;
+    }
+    memcpy(op, ip, literalLen);
+    ip += literalLen;
+    op += literalLen;
+
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+
+    size_t matchLen = token & 0xf;
+    if (matchLen == 15) {
+      unsigned char c;
+      do {
+        if (ip == end) {
+          return -1;
+        }
+        c = *ip++;
+        matchLen += c;
+      } while (c == 255);
+    }
+    matchLen += MIN_MATCH;
+
+    if (!offset || offset > (size_t) (op - (unsigned char *) dst) ||
+        (size_t) (opEnd - op) < matchLen) {
+      return -1;
+    }
+
+    /* Overlapping matches repeat the bytes just written, so copy forwards */
+    const unsigned char *ref = op - offset;
+    if (offset >= matchLen) {
+      memcpy(op, ref, matchLen);
+      op += matchLen;
+    } else {
+      for (size_t i=0; i<matchLen; ++i) {
+        *op++ = ref[i];
+      }
+    }
+  }
+
+  return op - (unsigned char *) dst;
+}
@@ -0,0 +1,22 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <sys/types.h>
+
+
+/* A byte-oriented LZ77 codec in the style of LZ4, built for speed over ratio
+   on repetitive terminal output
+
+   A compressed block is a series of sequences, each a token byte (literal
+   count in the high nibble, match length - 4 in the low one, 15 meaning more
+   length bytes follow), the literals, and a 16-bit little-endian offset back
+   to the match. The last sequence has literals only. Matches are found with a
+   single-entry hash table of 4-byte prefixes, so inputs are limited to 64 KiB
+   windows (LZ_MAX_OFFSET) but any length is accepted */
+const size_t LZ_MAX_OFFSET = 65535;
+
+size_t lzBound(size_t len);
+size_t lzCompress(const char *src, size_t len, char *dst, size_t dstLen);
+ssize_t lzDecompress(const char *src, size_t len, char *dst, size_t dstLen);
+
+#endif
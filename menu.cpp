@@ -1,7 +1,10 @@
 #include "menu.h"
 #include "utils.h"
 
+#include <algorithm>
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -13,30 +16,31 @@ const char *DIR_CODES[] = {
   "\033[%dC"
 };
 
-Menu::Menu(const std::vector<std::string> &options, bool altBuf, bool rawIO):
+Menu::Menu(const std::vector<std::string> &options, bool altBuf, bool rawIO,
+  int current):
     options(options),
-    current(0),
+    current(std::min(std::max(current, 0), (int) options.size() - 1)),
     altBuf(altBuf),
     rawIO(rawIO),
-    active(true)
+    active(true),
+    escState(0)
 {
   if (rawIO) {
     toTerminalRawIO();
   }
 
   if (altBuf) {
-    printf("%s", TO_ALT_BUF);
-    fflush(stdout);
+    print("%s", TO_ALT_BUF);
   }
 
-  printf("Use UP/DOWN to navigate, ENTER to select an option, SPACE to exit.\r\n");
+  print("Use UP/DOWN to navigate, ENTER to select an option, SPACE to exit.\r\n");
   displayMenu();
 }
 
 void Menu::makeMenuSpace()
 {
   for (int i=0; i<options.size(); ++i) {
-    printf("\r\n");
+    print("\r\n");
   }
 }
 
@@ -51,9 +55,9 @@ void Menu::printMenu()
 {
   for (int i=0; i<options.size(); ++i) {
     if (i == current) {
-      printf("%s%s%s\r\n", BG_BLUE, options.at(i).c_str(), RESET);
+      print("%s%s%s\r\n", BG_BLUE, options.at(i).c_str(), RESET);
     } else {
-      printf("%s\r\n", options.at(i).c_str());
+      print("%s\r\n", options.at(i).c_str());
     }
   }
 }
@@ -63,32 +67,90 @@ void Menu::printMenu()
 int Menu::run()
 {
   int res;
-  while ((res = fgetc(stdin)) != KEY_SPACE) {
-    if (res == KEY_ESC && (res = fgetc(stdin)) == KEY_LSQBR) {
-      // printf("ARROW PRESS!\r\n");
-      switch ((res = fgetc(stdin))) {
-      case KEY_UP:
-        updateMenu(CursorDir::UP);
-        break;
-      case KEY_DOWN:
-        updateMenu(CursorDir::DOWN);
-        break;
-      }
+  flushOutput();
+
+  while ((res = fgetc(stdin)) != EOF) {
+    res = feed(res);
+    flushOutput();
+    if (res != PENDING) {
+      return res;
     }
+  }
+
+  if (ferror(stdin)) {
+    sysError("fgetc");
+  }
+  return STDINEOF;
+}
+
+/* Handle one key press, returning the user's choice, NOCHOICE on the user
+   declining or PENDING until either happens
 
-    if (res == EOF) {
-      if (ferror(stdin)) {
-        sysError("fgetc");
-      }
-      return STDINEOF;
-    } else if (res == KEY_SPACE) {
-      break;
-    } else if (res == KEY_ENTER) {
-      return current;
+   In cursor mode, up/down arrow press sends 3 bytes: esc, [ and A/B */
+int Menu::feed(int c)
+{
+  if (escState == 1) {
+    escState = c == KEY_LSQBR ? 2 : 0;
+    if (escState) {
+      return PENDING;
+    }
+  } else if (escState == 2) {
+    escState = 0;
+    switch (c) {
+    case KEY_UP:
+      updateMenu(CursorDir::UP);
+      return PENDING;
+    case KEY_DOWN:
+      updateMenu(CursorDir::DOWN);
+      return PENDING;
     }
   }
 
-  return NOCHOICE;
+  if (c == KEY_ESC) {
+    escState = 1;
+  } else if (c == KEY_SPACE) {
+    return NOCHOICE;
+  } else if (c == KEY_ENTER) {
+    return current;
+  }
+
+  return PENDING;
+}
+
+/* The highlighted option, e.g. to keep it when the Menu is rebuilt */
+int Menu::selection() const
+{
+  return current;
+}
+
+std::string Menu::takeOutput()
+{
+  std::string res;
+  res.swap(output);
+  return res;
+}
+
+void Menu::print(const char *format, ...)
+{
+  char buf[512];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+
+  if (len > 0) {
+    output.append(buf, std::min((size_t) len, sizeof(buf) - 1));
+  }
+}
+
+void Menu::flushOutput()
+{
+  if (!output.empty()) {
+    fputs(output.c_str(), stdout);
+    fflush(stdout);
+    output.clear();
+  }
 }
 
 void Menu::updateMenu(CursorDir dir)
@@ -107,7 +169,7 @@ void Menu::updateMenu(CursorDir dir)
 
 void Menu::scroll(CursorDir dir, int n)
 {
-  printf(DIR_CODES[(int) dir], n);
+  print(DIR_CODES[(int) dir], n);
 }
 
 void Menu::close()
@@ -122,8 +184,8 @@ void Menu::close()
   }
 
   if (altBuf) {
-    printf("%s", FROM_ALT_BUF);
-    fflush(stdout);
+    print("%s", FROM_ALT_BUF);
+    flushOutput();
   }
 }
 
@@ -16,6 +16,9 @@
 #define FROM_ALT_BUF "\033[?1049l"
 
 /* Key presses */
+#define KEY_CTRL_A 1
+#define KEY_CTRL_C 3
+#define KEY_BACKSPACE 8
 #define KEY_SPACE 32
 #define KEY_ESC 27
 #define KEY_LSQBR 91
@@ -23,9 +26,15 @@
 #define KEY_DOWN 66
 #define KEY_ENTER 13
 #define KEY_DQUOTE 34
+#define KEY_SLASH 47
 #define KEY_LOWER_C 99
+#define KEY_LOWER_D 100
 #define KEY_LOWER_N 110
+#define KEY_LOWER_S 115
+#define KEY_LOWER_T 116
 #define KEY_UPPER_N 78
+#define KEY_UPPER_T 84
+#define KEY_DEL 127
 
 /* Cursor directions */
 extern const char *DIR_CODES[4];
@@ -42,20 +51,31 @@ enum class CursorDir {
    Run: wait for user to choose an option and return
    Destructor: possibly switch back to main buffer
 
+   Output is collected rather than printed directly. run() and close() read
+   stdin and print to stdout themselves, while an event loop can instead
+   feed() it keys as they arrive and send takeOutput() wherever it displays
+
    Note: assumes terminal in raw IO mode!
    Todo: allow option for scoped rawio mode */
 class Menu {
 public:
   static const int STDINEOF = -1;
   static const int NOCHOICE = -2;
+  static const int PENDING = -3;
 
-  Menu(const std::vector<std::string> &options, bool altBuf=true, bool rawIO=true);
+  Menu(const std::vector<std::string> &options, bool altBuf=true, bool rawIO=true,
+    int current=0);
   ~Menu();
 
   int run();
+  int feed(int c);
+  int selection() const;
+  std::string takeOutput();
   void close();
 
 private:
+  void print(const char *format, ...);
+  void flushOutput();
   void makeMenuSpace();
   void displayMenu();
   void printMenu();
@@ -70,6 +90,8 @@ private:
   bool rawIO;
   struct termios savedSettings;
   bool active;
+  int escState;
+  std::string output;
 };
 
 #endif
@@ -0,0 +1,115 @@
+#include "outputstage.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+
+/* Chunks smaller than this are appended to rather than followed by another,
+   and at most OUTPUT_IOVECS of them go in one writev() */
+const size_t OUTPUT_CHUNK = 16 * 1024;
+const int OUTPUT_IOVECS = 64;
+
+OutputStage::OutputStage(int fd, size_t highWater):
+  _fd(fd),
+  _flags(fcntl(fd, F_GETFL)),
+  _highWater(highWater),
+  _size(0),
+  _offset(0)
+{
+  if (_flags == -1 || fcntl(fd, F_SETFL, _flags | O_NONBLOCK) == -1) {
+    sysError("fcntl");
+  }
+}
+
+/* Give the terminal whatever is left, unless it has gone */
+OutputStage::~OutputStage()
+{
+  struct pollfd pfd = {_fd, POLLOUT, 0};
+
+  try {
+    while (!flush()) {
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        break;
+      }
+    }
+  } catch (const std::exception &) {
+  }
+
+  fcntl(_fd, F_SETFL, _flags);
+}
+
+void OutputStage::send(const char *buf, size_t len)
+{
+  if (!len) {
+    return;
+  }
+
+  if (_chunks.empty() || _chunks.back().size() >= OUTPUT_CHUNK) {
+    _chunks.emplace_back();
+  }
+  _chunks.back().append(buf, len);
+  _size += len;
+}
+
+/* Write as much as the descriptor takes without blocking, returning whether
+   everything has been */
+bool OutputStage::flush()
+{
+  while (_size) {
+    struct iovec iov[OUTPUT_IOVECS];
+    int iovcnt = 0;
+
+    for (auto it=_chunks.begin(); it!=_chunks.end() && iovcnt<OUTPUT_IOVECS;
+        ++it) {
+      size_t skip = iovcnt ? 0 : _offset;
+      iov[iovcnt].iov_base = (char *) it->data() + skip;
+      iov[iovcnt].iov_len = it->size() - skip;
+      ++iovcnt;
+    }
+
+    ssize_t res;
+    {
+      TraceSpan span(TRACE_TERMINAL_WRITE);
+      res = span.len = writev(_fd, iov, iovcnt);
+    }
+
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 && errno == EAGAIN) {
+      return false;
+    } else if (res == -1) {
+      sysError("writev");
+    }
+
+    _size -= res;
+    res += _offset;
+    while (!_chunks.empty() && (size_t) res >= _chunks.front().size()) {
+      res -= _chunks.front().size();
+      _chunks.pop_front();
+    }
+    _offset = res;
+  }
+
+  return true;
+}
+
+size_t OutputStage::size() const
+{
+  return _size;
+}
+
+bool OutputStage::empty() const
+{
+  return !_size;
+}
+
+bool OutputStage::full() const
+{
+  return _size > _highWater;
+}
@@ -0,0 +1,53 @@
+#ifndef OUTPUTSTAGE_H
+#define OUTPUTSTAGE_H
+
+#include <deque>
+#include <string>
+
+#include <sys/types.h>
+
+
+/* Bytes staged past this are left for the terminal to catch up on before any
+   more frames are produced for it */
+const size_t OUTPUT_HIGH_WATER = 1024 * 1024;
+
+/* Everything bound for a terminal (frames, Menus, a window's raw output),
+   staged in the order sent and written with writev() whenever the descriptor
+   takes it, so a slow terminal (e.g. over ssh) never blocks the caller
+
+   The descriptor is made non-blocking for as long as the stage exists. Note
+   that a terminal's stdin and stdout usually share one open file, so stdin
+   turns non-blocking too. On destruction, whatever is still staged is written
+   out blocking and the descriptor's flags are restored
+
+   Small sends are appended to the last chunk, so a burst of them still
+   goes out in a handful of iovecs. Past highWater, full() tells the caller to
+   stop producing output, e.g. skip frames or stop reading a window, while the
+   staged bytes drain */
+class OutputStage {
+public:
+  OutputStage(int fd, size_t highWater=OUTPUT_HIGH_WATER);
+  ~OutputStage();
+
+  OutputStage(const OutputStage &other) = delete;
+  OutputStage &operator=(const OutputStage &other) = delete;
+
+  void send(const char *buf, size_t len);
+  bool flush();
+
+  size_t size() const;
+  bool empty() const;
+  bool full() const;
+
+private:
+  int _fd;
+  int _flags;
+  size_t _highWater;
+  std::deque<std::string> _chunks;
+
+  /* Bytes staged, and how much of the first chunk has been written */
+  size_t _size;
+  size_t _offset;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "poller.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+
+Poller::Poller():
+  _epfd(epoll_create1(EPOLL_CLOEXEC))
+{
+  if (_epfd == -1) {
+    sysError("epoll_create1");
+  }
+}
+
+Poller::~Poller()
+{
+  close(_epfd);
+}
+
+void Poller::add(int fd, uint32_t events)
+{
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    sysError("epoll_ctl");
+  }
+}
+
+void Poller::modify(int fd, uint32_t events)
+{
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+    sysError("epoll_ctl");
+  }
+}
+
+/* Closing a descriptor removes it implicitly (once all duplicates are closed),
+   so ENOENT/EBADF here are not worth reporting */
+void Poller::remove(int fd)
+{
+  epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Returns the number of ready descriptors, retrying if interrupted by a signal
+   so that callers need not special case EINTR */
+int Poller::wait(struct epoll_event *events, int maxEvents, int timeout)
+{
+  int res;
+
+  do {
+    res = epoll_wait(_epfd, events, maxEvents, timeout);
+  } while (res == -1 && errno == EINTR);
+
+  if (res == -1) {
+    sysError("epoll_wait");
+  }
+  return res;
+}
@@ -0,0 +1,31 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+
+/* Readiness notification for any number of descriptors, backed by epoll
+
+   Unlike select(), there is no FD_SETSIZE ceiling and the interest set lives
+   in the kernel, so a wait costs O(ready) rather than O(watched). Events are
+   level-triggered, so a descriptor which still has data is simply reported
+   again on the next wait */
+class Poller {
+public:
+  Poller();
+  ~Poller();
+
+  Poller(const Poller &other) = delete;
+  Poller &operator=(const Poller &other) = delete;
+
+  void add(int fd, uint32_t events=EPOLLIN);
+  void modify(int fd, uint32_t events);
+  void remove(int fd);
+  int wait(struct epoll_event *events, int maxEvents, int timeout=-1);
+
+private:
+  int _epfd;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "protocol.h"
+#include "utils.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+
+/* $SCREENS_SOCKET, or a per-user directory under /tmp which only its owner may
+   enter, since anyone who can connect can type into every window */
+std::string socketPath()
+{
+  const char *path = getenv("SCREENS_SOCKET");
+  if (path && *path) {
+    return path;
+  }
+
+  std::string dir = "/tmp/screens-" + std::to_string(getuid());
+  if (!privateDir(dir)) {
+    throw std::runtime_error("Refusing to use " + dir + ": " +
+      strError(errno));
+  }
+  return dir + "/default";
+}
+
+/* Frames larger than MAX_PAYLOAD are the caller's to split. MSG_NOSIGNAL turns
+   a vanished peer into EPIPE rather than a fatal SIGPIPE */
+bool sendMessage(int sock, uint8_t type, int32_t arg, const char *buf,
+  size_t len, int passFd)
+{
+  MessageHeader header = {};
+  header.type = type;
+  header.arg = arg;
+
+  struct iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void *) buf;
+  iov[1].iov_len = len;
+
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = len ? 2 : 1;
+
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  if (passFd != -1) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+  }
+
+  ssize_t res;
+  do {
+    res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (res == -1 && errno == EINTR);
+
+  return res != -1;
+}
+
+/* Returns the message length, header included, 0 once the peer has gone or -1
+   on error. passedFd is -1 unless a descriptor came with the message */
+ssize_t recvMessage(int sock, MessageHeader &header, std::string &payload,
+  int &passedFd)
+{
+  char buf[MAX_PAYLOAD];
+  struct iovec iov[2];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = sizeof(buf);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t res;
+  do {
+    res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (res == -1 && errno == EINTR);
+
+  passedFd = -1;
+  if (res <= 0) {
+    return res;
+  } else if ((size_t) res < sizeof(header)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&passedFd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  payload.assign(buf, res - sizeof(header));
+  return res;
+}
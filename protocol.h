@@ -0,0 +1,73 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Messages between the session daemon and its attach clients
+
+   The Unix socket is SOCK_SEQPACKET, so each message arrives whole: a
+   MessageHeader followed by up to MAX_PAYLOAD bytes. A descriptor may ride
+   along with any message as SCM_RIGHTS ancillary data.
+
+   Client to daemon:
+   HELLO      attaches, alongside any other clients. arg is rows << 16 |
+              cols of the client's terminal
+   INPUT      keystrokes for the daemon to interpret
+   OUTPUT     bytes the client read from window arg's fdm, for its scrollback
+   RELEASE    the client no longer reads window arg's fdm
+   HISTORY    asks for window arg's scrollback, -1 meaning the current window.
+              Doesn't require attaching
+   STATS      asks for every window's counters. Doesn't require attaching
+   TRACE      starts (arg 1) or stops (arg 0) tracing, or dumps the trace
+              (arg -1). Doesn't require attaching
+
+   Daemon to client:
+   FRAME      bytes for the client's terminal
+   FOREGROUND the client should read from and write to window arg's fdm,
+              which is attached, directly. An arg of -1 means send all input
+              through the daemon, and the window already held without an fdm
+              means carry on. Sent once for every HELLO and INPUT, after any
+              FRAMEs they caused
+   DETACH     the client detached, or the daemon is exiting
+   RECLAIM    stop using window arg's fdm, since another client attached.
+              Input goes through the daemon until the next FOREGROUND says
+              otherwise
+   HISTORY    window arg's scrollback as a read-only SharedRing descriptor,
+              which is attached unless there is no such window
+   STATS      the counters as JSON, split over as many messages as it takes,
+              arg being 1 on all but the last
+   TRACE      whether tracing is on, with the path of the file dumped to
+              if any */
+enum MessageType : uint8_t {
+  MSG_HELLO,
+  MSG_INPUT,
+  MSG_OUTPUT,
+  MSG_RELEASE,
+  MSG_FRAME,
+  MSG_FOREGROUND,
+  MSG_DETACH,
+  MSG_HISTORY,
+  MSG_STATS,
+  MSG_TRACE,
+  MSG_RECLAIM
+};
+
+struct MessageHeader {
+  uint8_t type;
+  int32_t arg;
+};
+
+const size_t MAX_PAYLOAD = 32 * 1024;
+
+std::string socketPath();
+
+bool sendMessage(int sock, uint8_t type, int32_t arg, const char *buf,
+  size_t len, int passFd=-1);
+ssize_t recvMessage(int sock, MessageHeader &header, std::string &payload,
+  int &passedFd);
+
+#endif
@@ -0,0 +1,344 @@
+#include "renderer.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+
+
+/* Up to this many unchanged cells are redrawn rather than jumped over, since
+   a cursor movement sequence is at least as long */
+const int MAX_REDRAW_GAP = 4;
+
+void appendUTF8(std::string &out, uint32_t ch)
+{
+  if (ch < 0x80) {
+    out += (char) ch;
+  } else if (ch < 0x800) {
+    out += (char) (0xc0 | (ch >> 6));
+    out += (char) (0x80 | (ch & 0x3f));
+  } else if (ch < 0x10000) {
+    out += (char) (0xe0 | (ch >> 12));
+    out += (char) (0x80 | ((ch >> 6) & 0x3f));
+    out += (char) (0x80 | (ch & 0x3f));
+  } else {
+    out += (char) (0xf0 | (ch >> 18));
+    out += (char) (0x80 | ((ch >> 12) & 0x3f));
+    out += (char) (0x80 | ((ch >> 6) & 0x3f));
+    out += (char) (0x80 | (ch & 0x3f));
+  }
+}
+
+void appendColor(std::string &out, uint32_t color, int base)
+{
+  char buf[32];
+  uint32_t value = color & 0xffffff;
+
+  if ((color & 0xff000000) == COLOR_RGB) {
+    snprintf(buf, sizeof(buf), ";%d;2;%u;%u;%u", base + 8,
+      value >> 16, (value >> 8) & 0xff, value & 0xff);
+  } else if (value < 8) {
+    snprintf(buf, sizeof(buf), ";%u", base + value);
+  } else if (value < 16) {
+    snprintf(buf, sizeof(buf), ";%u", base + 60 + value - 8);
+  } else {
+    snprintf(buf, sizeof(buf), ";%d;5;%u", base + 8, value);
+  }
+  out += buf;
+}
+
+/* A complete SGR sequence which sets attr from any prior state */
+void appendSGR(std::string &out, const Attr &attr)
+{
+  static const uint8_t flags[] = {
+    ATTR_BOLD, ATTR_DIM, ATTR_ITALIC, ATTR_UNDERLINE,
+    ATTR_BLINK, ATTR_REVERSE, ATTR_HIDDEN, ATTR_STRIKE
+  };
+  static const char *codes[] = {";1", ";2", ";3", ";4", ";5", ";7", ";8", ";9"};
+
+  out += "\x1b[0";
+  for (int i=0; i<8; ++i) {
+    if (attr.flags & flags[i]) {
+      out += codes[i];
+    }
+  }
+  if (attr.fg != COLOR_DEFAULT) {
+    appendColor(out, attr.fg, 30);
+  }
+  if (attr.bg != COLOR_DEFAULT) {
+    appendColor(out, attr.bg, 40);
+  }
+  out += "m";
+}
+
+void appendMode(std::string &out, int mode, bool on)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[?%d%c", mode, on ? 'h' : 'l');
+  out += buf;
+}
+
+uint64_t hashRow(const Cell *row, int cols)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int c=0; c<cols; ++c) {
+    uint64_t fields[] = {row[c].ch, row[c].attr.fg, row[c].attr.bg,
+      row[c].attr.flags};
+    for (uint64_t field : fields) {
+      hash = (hash ^ field) * 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+Renderer::Renderer():
+  _valid(false),
+  _rows(0),
+  _cols(0)
+{}
+
+void Renderer::invalidate()
+{
+  _valid = false;
+}
+
+/* Returns the bytes which bring the terminal from the last frame to screen */
+std::string Renderer::render(const Screen &screen)
+{
+  std::string out;
+
+  if (!_valid || _rows != screen.rows() || _cols != screen.cols()) {
+    reset(out, screen);
+  }
+
+  int n = detectScroll(screen);
+  if (n) {
+    scroll(out, n);
+  }
+
+  std::string cells;
+  for (int r=0; r<_rows; ++r) {
+    drawRow(cells, screen, r);
+  }
+
+  /* Don't show the cursor jumping about while drawing */
+  if (!cells.empty() && _cursorVisible) {
+    out += "\x1b[?25l";
+    _cursorVisible = false;
+  }
+  out += cells;
+
+  renderModes(out, screen);
+  return out;
+}
+
+/* Clear the terminal and forget every mode, so that all are sent again
+
+   The terminal may have been written to by something else since the last
+   frame (e.g. a client passing a window's output straight through), so the
+   alternate screen, scroll region and common input modes are put back into a
+   known state too rather than trusting _modes */
+void Renderer::reset(std::string &out, const Screen &screen)
+{
+  static const int commonModes[] = {1, 1000, 1002, 1003, 1004, 1005, 1006,
+    1015, 2004};
+
+  _rows = screen.rows();
+  _cols = screen.cols();
+  _cells.assign(_rows * _cols, DEFAULT_CELL);
+
+  out += "\x1b[?1049h\x1b[0m\x1b[r\x1b[4l\x1b[?6l\x1b(B\x0f\x1b[H\x1b[2J";
+  _row = 0;
+  _col = 0;
+  _attr = DEFAULT_ATTR;
+
+  _cursorVisible = true;
+  out += "\x1b[?25h";
+  _appKeypad = false;
+  out += "\x1b>";
+  for (int mode : commonModes) {
+    _modes[mode] = true;
+  }
+  for (auto &mode : _modes) {
+    if (mode.second) {
+      appendMode(out, mode.first, false);
+    }
+  }
+  _modes.clear();
+
+  _valid = true;
+}
+
+/* Returns n > 0 if the screen looks like the last frame scrolled up by n rows,
+   i.e. more rows line up that way than where they are */
+int Renderer::detectScroll(const Screen &screen) const
+{
+  std::vector<uint64_t> have(_rows);
+  std::vector<uint64_t> want(_rows);
+  int inPlace = 0;
+
+  for (int r=0; r<_rows; ++r) {
+    have[r] = hashRow(&_cells[r * _cols], _cols);
+    want[r] = hashRow(&screen.cell(r, 0), _cols);
+    inPlace += have[r] == want[r];
+  }
+
+  int best = 0;
+  int bestMatches = inPlace;
+  for (int n=1; n<_rows; ++n) {
+    if (want[0] != have[n]) {
+      continue;
+    }
+
+    int matches = 0;
+    for (int r=0; r+n<_rows; ++r) {
+      matches += want[r] == have[r + n];
+    }
+    if (matches > bestMatches) {
+      best = n;
+      bestMatches = matches;
+    }
+  }
+
+  return best;
+}
+
+/* Scroll the terminal up by n rows, which blanks the uncovered rows with the
+   current background */
+void Renderer::scroll(std::string &out, int n)
+{
+  char buf[32];
+
+  setAttr(out, DEFAULT_ATTR);
+  snprintf(buf, sizeof(buf), "\x1b[%dS", n);
+  out += buf;
+
+  std::copy(_cells.begin() + n * _cols, _cells.end(), _cells.begin());
+  std::fill(_cells.end() - n * _cols, _cells.end(), DEFAULT_CELL);
+}
+
+/* Draw the changed cells of a row. Once the rest of the row is meant to be
+   blank, erasing to the end of the line is shorter than drawing spaces */
+void Renderer::drawRow(std::string &out, const Screen &screen, int row)
+{
+  const Cell *want = &screen.cell(row, 0);
+  Cell *have = &_cells[row * _cols];
+
+  int blankFrom = _cols;
+  while (blankFrom > 0 && want[blankFrom - 1] == DEFAULT_CELL) {
+    --blankFrom;
+  }
+
+  for (int c=0; c<_cols; ++c) {
+    if (want[c] == have[c]) {
+      continue;
+    }
+
+    if (c >= blankFrom) {
+      moveTo(out, row, c);
+      setAttr(out, DEFAULT_ATTR);
+      out += "\x1b[K";
+      std::fill(have + c, have + _cols, DEFAULT_CELL);
+      return;
+    }
+
+    /* A changed right half of a wide character is redrawn from its left */
+    if (!want[c].ch && c > 0) {
+      --c;
+    }
+
+    /* Redraw a short run of unchanged cells rather than jumping over it */
+    if (_row == row && _col < c && c - _col <= MAX_REDRAW_GAP) {
+      while (_col < c) {
+        drawCell(out, screen, row, _col);
+      }
+    }
+    moveTo(out, row, c);
+    drawCell(out, screen, row, c);
+
+    /* drawCell() may have drawn a wide character */
+    c = _row == row ? _col - 1 : _cols;
+  }
+}
+
+/* Draw a cell at the cursor, which moves past it */
+void Renderer::drawCell(std::string &out, const Screen &screen, int row,
+  int col)
+{
+  const Cell &cell = screen.cell(row, col);
+  int width = col + 1 < _cols && !screen.cell(row, col + 1).ch ? 2 : 1;
+
+  setAttr(out, cell.attr);
+  appendUTF8(out, cell.ch ? cell.ch : ' ');
+
+  Cell *have = &_cells[row * _cols + col];
+  std::copy(&cell, &cell + width, have);
+
+  _col += width;
+  if (_col >= _cols) {
+    _row = -1;
+  }
+}
+
+/* Input-related modes follow the screen so that keys are encoded the way the
+   window expects, and the cursor ends up where the window left it */
+void Renderer::renderModes(std::string &out, const Screen &screen)
+{
+  const std::map<int, bool> &modes = screen.passModes();
+
+  for (auto &mode : modes) {
+    auto it = _modes.find(mode.first);
+    bool was = it != _modes.end() && it->second;
+    if (was != mode.second) {
+      appendMode(out, mode.first, mode.second);
+    }
+  }
+  for (auto &mode : _modes) {
+    if (mode.second && !modes.count(mode.first)) {
+      appendMode(out, mode.first, false);
+    }
+  }
+  _modes = modes;
+
+  if (_appKeypad != screen.appKeypad()) {
+    _appKeypad = screen.appKeypad();
+    out += _appKeypad ? "\x1b=" : "\x1b>";
+  }
+
+  const Cursor &cursor = screen.cursor();
+  moveTo(out, cursor.row, cursor.col);
+  setAttr(out, cursor.attr);
+
+  if (_cursorVisible != screen.cursorVisible()) {
+    _cursorVisible = screen.cursorVisible();
+    appendMode(out, 25, _cursorVisible);
+  }
+}
+
+/* Relative moves for short hops on the same row, an absolute one otherwise */
+void Renderer::moveTo(std::string &out, int row, int col)
+{
+  char buf[32];
+
+  if (_row == row && _col == col) {
+    return;
+  } else if (_row == row && col == 0) {
+    out += "\r";
+  } else if (_row == row && col < _col && _col - col <= MAX_REDRAW_GAP) {
+    out.append(_col - col, '\b');
+  } else {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row + 1, col + 1);
+    out += buf;
+  }
+
+  _row = row;
+  _col = col;
+}
+
+void Renderer::setAttr(std::string &out, const Attr &attr)
+{
+  if (attr != _attr) {
+    appendSGR(out, attr);
+    _attr = attr;
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "screen.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+
+/* Draws Screens onto a real terminal, remembering the last frame sent so that
+   each render() emits only the cursor moves, renditions and text which differ
+   from it
+
+   Whole-screen scrolls (e.g. a cat or a build log) are detected and sent as a
+   single scroll-up, so only the newly uncovered rows are drawn. A frame built
+   by render() is meant to be written out in one go. After anything else has
+   drawn on the terminal (e.g. a Menu), invalidate() makes the next frame a
+   full repaint */
+class Renderer {
+public:
+  Renderer();
+
+  void invalidate();
+  std::string render(const Screen &screen);
+
+private:
+  void reset(std::string &out, const Screen &screen);
+  int detectScroll(const Screen &screen) const;
+  void scroll(std::string &out, int n);
+  void drawRow(std::string &out, const Screen &screen, int row);
+  void drawCell(std::string &out, const Screen &screen, int row, int col);
+  void renderModes(std::string &out, const Screen &screen);
+  void moveTo(std::string &out, int row, int col);
+  void setAttr(std::string &out, const Attr &attr);
+
+  bool _valid;
+  int _rows;
+  int _cols;
+  std::vector<Cell> _cells;
+
+  /* Where the terminal's cursor is and its rendition, a row of -1 meaning the
+     position is unknown (e.g. pending an autowrap) */
+  int _row;
+  int _col;
+  Attr _attr;
+
+  bool _cursorVisible;
+  bool _appKeypad;
+  std::map<int, bool> _modes;
+};
+
+#endif
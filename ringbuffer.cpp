@@ -62,19 +62,19 @@ RingBuffer::~RingBuffer()
   delete[] _buffer;
 }
 
-size_t RingBuffer::size()
+size_t RingBuffer::size() const
 {
   return _size;
 }
 
-size_t RingBuffer::capacity()
+size_t RingBuffer::capacity() const
 {
   return _capacity;
 }
 
 /* If we overwrite the previous _start, the  _start simply follows the new
    _end */
-void RingBuffer::write(char *from, size_t len)
+void RingBuffer::write(const char *from, size_t len)
 {
   bool overflow = len > (_capacity - _size);
   size_t i = 0;
@@ -127,3 +127,56 @@ size_t RingBuffer::read(char *into, size_t len)
   _size -= toRead;
   return toRead;
 }
+
+/* Like read(), without copying, e.g. once segments() have been written out */
+size_t RingBuffer::discard(size_t len)
+{
+  size_t toDiscard = std::min(len, _size);
+  _start = (_start + toDiscard) % _capacity;
+  _size -= toDiscard;
+  return toDiscard;
+}
+
+/* Describe the queued bytes from offset bytes past _start, oldest first, as at
+   most two spans which point straight into the buffer, e.g. for writev().
+   Returns the number of spans filled in, which are only valid until the next
+   write() */
+int RingBuffer::segments(struct iovec iov[2], size_t offset) const
+{
+  if (offset >= _size) {
+    return 0;
+  }
+
+  size_t len = _size - offset;
+  size_t pos = (_start + offset) % _capacity;
+
+  size_t firstLen = std::min(len, _capacity - pos);
+  iov[0].iov_base = _buffer + pos;
+  iov[0].iov_len = firstLen;
+
+  if (firstLen == len) {
+    return 1;
+  }
+
+  iov[1].iov_base = _buffer;
+  iov[1].iov_len = len - firstLen;
+  return 2;
+}
+
+/* Like read(), but copies from offset bytes past _start and leaves the queue
+   untouched */
+size_t RingBuffer::peek(char *into, size_t len, size_t offset) const
+{
+  if (offset >= _size) {
+    return 0;
+  }
+
+  size_t toRead = std::min(len, _size - offset);
+  size_t pos = (_start + offset) % _capacity;
+
+  size_t firstLen = std::min(toRead, _capacity - pos);
+  memcpy(into, _buffer + pos, firstLen);
+  memcpy(into + firstLen, _buffer, toRead - firstLen);
+
+  return toRead;
+}
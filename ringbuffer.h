@@ -2,6 +2,7 @@
 #define RINGBUFFER_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 
 /* A circular binary queue which allows overwriting the oldest bytes */
@@ -14,10 +15,15 @@ public:
   RingBuffer(RingBuffer &&other);
   ~RingBuffer();
 
-  size_t size();
-  size_t capacity();
-  void write(char *from, size_t len);
+  size_t size() const;
+  size_t capacity() const;
+  void write(const char *from, size_t len);
   size_t read(char *into, size_t len);
+  size_t discard(size_t len);
+
+  /* Non-destructive access, neither moves _start */
+  int segments(struct iovec iov[2], size_t offset=0) const;
+  size_t peek(char *into, size_t len, size_t offset=0) const;
 
 private:
   void swapWith(RingBuffer &other);
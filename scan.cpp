@@ -0,0 +1,115 @@
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+
+typedef size_t (*ScanFn)(const char *buf, size_t len);
+
+/* Eight bytes at a time: a word is skipped if none of its bytes is below 0x20
+   or above 0x7e (which includes those with the top bit set), and searched
+   bytewise otherwise */
+size_t scanScalar(const char *buf, size_t len)
+{
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, buf + i, sizeof(word));
+
+    uint64_t below = (word - ones * 0x20) & ~word;
+    uint64_t above = (word + ones * (127 - 0x7e)) | word;
+    if ((below | above) & highs) {
+      break;
+    }
+  }
+
+  for (; i < len; ++i) {
+    unsigned char c = buf[i];
+    if (c < 0x20 || c > 0x7e) {
+      break;
+    }
+  }
+  return i;
+}
+
+#ifdef SCAN_X86
+/* Bytes compare as signed, so those with the top bit set are negative and fail
+   the lower bound along with the control bytes */
+__attribute__((target("sse2")))
+size_t scanSSE2(const char *buf, size_t len)
+{
+  const __m128i low = _mm_set1_epi8(0x1f);
+  const __m128i high = _mm_set1_epi8(0x7f);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high));
+    int mask = ~_mm_movemask_epi8(ok) & 0xffff;
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + scanScalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t scanAVX2(const char *buf, size_t len)
+{
+  const __m256i low = _mm256_set1_epi8(0x1f);
+  const __m256i high = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+    __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, low),
+      _mm256_cmpgt_epi8(high, v));
+    uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(ok);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + scanSSE2(buf + i, len - i);
+}
+#endif
+
+struct ScanImpl {
+  ScanFn fn;
+  const char *name;
+};
+
+ScanImpl resolveScan()
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {scanAVX2, "avx2"};
+  } else if (__builtin_cpu_supports("sse2")) {
+    return {scanSSE2, "sse2"};
+  }
+#endif
+  return {scanScalar, "scalar"};
+}
+
+const ScanImpl scanImpl = resolveScan();
+
+size_t scanPrintable(const char *buf, size_t len)
+{
+  return scanImpl.fn(buf, len);
+}
+
+/* Name of the kernel in use, e.g. for benchmarks */
+const char *scanKernel()
+{
+  return scanImpl.name;
+}
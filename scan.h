@@ -0,0 +1,16 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <sys/types.h>
+
+
+/* Returns the offset of the first byte in buf which isn't printable ASCII
+   (0x20 to 0x7e), i.e. a control byte such as ESC, CR, LF or BEL, DEL or any
+   byte of a UTF-8 sequence, or len if there is none
+
+   The kernel (AVX2, SSE2 or portable scalar) is picked once at startup for
+   the host CPU, so one binary runs everywhere */
+size_t scanPrintable(const char *buf, size_t len);
+const char *scanKernel();
+
+#endif
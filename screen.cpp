@@ -0,0 +1,841 @@
+#include "screen.h"
+#include "scan.h"
+
+#include <algorithm>
+
+#include <wchar.h>
+
+
+/* DEC special graphics, which replace 0x5f to 0x7e when a charset is '0' */
+const uint32_t DEC_GRAPHICS[] = {
+  0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+  0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+  0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+  0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+};
+
+Screen::Screen(int rows, int cols):
+  _rows(std::max(rows, 1)),
+  _cols(std::max(cols, 1))
+{
+  reset();
+}
+
+/* Power-on state, also reached by RIS (ESC c) */
+void Screen::reset()
+{
+  _cells.assign(_rows * _cols, DEFAULT_CELL);
+  _otherCells.assign(_rows * _cols, DEFAULT_CELL);
+  _lines.resize(_rows);
+  for (int r=0; r<_rows; ++r) {
+    _lines[r] = r;
+  }
+  _otherLines = _lines;
+  _altScreen = false;
+
+  _cursor = {0, 0, DEFAULT_ATTR, false, {'B', 'B'}, 0};
+  _savedCursor = _cursor;
+  _altSavedCursor = _cursor;
+  _wrapPending = false;
+  _top = 0;
+  _bottom = _rows - 1;
+
+  _tabs.assign(_cols, false);
+  for (int i=8; i<_cols; i+=8) {
+    _tabs[i] = true;
+  }
+
+  _autowrap = true;
+  _insertMode = false;
+  _cursorVisible = true;
+  _appKeypad = false;
+  _passModes.clear();
+
+  _state = State::GROUND;
+  _params.clear();
+  _prefix = 0;
+  _intermediate = 0;
+  _utf8 = 0;
+  _utf8Left = 0;
+}
+
+int Screen::rows() const
+{
+  return _rows;
+}
+
+int Screen::cols() const
+{
+  return _cols;
+}
+
+const Cell &Screen::cell(int row, int col) const
+{
+  return _cells[_lines[row] * _cols + col];
+}
+
+const Cursor &Screen::cursor() const
+{
+  return _cursor;
+}
+
+bool Screen::cursorVisible() const
+{
+  return _cursorVisible;
+}
+
+bool Screen::appKeypad() const
+{
+  return _appKeypad;
+}
+
+const std::map<int, bool> &Screen::passModes() const
+{
+  return _passModes;
+}
+
+/* Runs of printable ASCII, which are most of a typical window's output, are
+   found by the vectorized scanner and drawn in bulk. Only the bytes it stops
+   at go through the state machine */
+void Screen::feed(const char *buf, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    if (_state == State::GROUND && !_utf8Left) {
+      size_t run = scanPrintable(buf + i, len - i);
+      if (run) {
+        printASCII(buf + i, run);
+        i += run;
+        continue;
+      }
+    }
+    feedByte(buf[i++]);
+  }
+}
+
+/* Control characters are executed whatever the state (except inside strings),
+   ESC always starts a new sequence and CAN/SUB abort the current one */
+void Screen::feedByte(unsigned char c)
+{
+  if (_state == State::STRING) {
+    if (c == 0x07) {
+      _state = State::GROUND;
+    } else if (c == 0x1b) {
+      _state = State::ESCAPE;
+      _intermediate = 0;
+    }
+    return;
+  }
+
+  if (c == 0x1b) {
+    _state = State::ESCAPE;
+    _intermediate = 0;
+    _utf8Left = 0;
+    return;
+  } else if (c == 0x18 || c == 0x1a) {
+    _state = State::GROUND;
+    _utf8Left = 0;
+    return;
+  } else if (c < 0x20 || c == 0x7f) {
+    if (c != 0x7f) {
+      control(c);
+    }
+    return;
+  }
+
+  switch (_state) {
+  case State::GROUND: {
+    if (c < 0x80) {
+      _utf8Left = 0;
+      print(c);
+    } else if ((c & 0xc0) == 0x80) {
+      if (!_utf8Left) {
+        print(0xfffd);
+      } else {
+        _utf8 = (_utf8 << 6) | (c & 0x3f);
+        if (!--_utf8Left) {
+          print(_utf8);
+        }
+      }
+    } else {
+      if (_utf8Left) {
+        print(0xfffd);
+      }
+      if ((c & 0xe0) == 0xc0) {
+        _utf8 = c & 0x1f;
+        _utf8Left = 1;
+      } else if ((c & 0xf0) == 0xe0) {
+        _utf8 = c & 0x0f;
+        _utf8Left = 2;
+      } else if ((c & 0xf8) == 0xf0) {
+        _utf8 = c & 0x07;
+        _utf8Left = 3;
+      } else {
+        _utf8Left = 0;
+        print(0xfffd);
+      }
+    }
+    break;
+  }
+  case State::ESCAPE: {
+    if (c >= 0x20 && c <= 0x2f) {
+      _intermediate = c;
+      _state = State::ESCAPE_INTERMEDIATE;
+    } else if (c == '[') {
+      _params.clear();
+      _prefix = 0;
+      _intermediate = 0;
+      _state = State::CSI;
+    } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+      /* OSC, DCS, SOS, PM and APC strings are skipped up to ST or BEL */
+      _state = State::STRING;
+    } else {
+      _state = State::GROUND;
+      escDispatch(c);
+    }
+    break;
+  }
+  case State::ESCAPE_INTERMEDIATE: {
+    if (c >= 0x20 && c <= 0x2f) {
+      _intermediate = c;
+    } else {
+      _state = State::GROUND;
+      escDispatch(c);
+    }
+    break;
+  }
+  case State::CSI: {
+    if (c >= '0' && c <= '9') {
+      if (_params.empty()) {
+        _params.push_back(0);
+      }
+      _params.back() = std::min(_params.back() * 10 + (c - '0'), 65535);
+    } else if (c == ';' || c == ':') {
+      if (_params.empty()) {
+        _params.push_back(0);
+      }
+      _params.push_back(0);
+    } else if (c >= 0x3c && c <= 0x3f) {
+      _prefix = c;
+    } else if (c >= 0x20 && c <= 0x2f) {
+      _intermediate = c;
+    } else if (c >= 0x40 && c <= 0x7e) {
+      _state = State::GROUND;
+      csiDispatch(c);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void Screen::print(uint32_t ch)
+{
+  char charset = _cursor.charsets[_cursor.shift];
+  if (charset == '0' && ch >= 0x5f && ch <= 0x7e) {
+    ch = DEC_GRAPHICS[ch - 0x5f];
+  }
+
+  /* wcwidth() gives -1 for anything the locale can't classify */
+  int width = ch < 0x80 ? 1 : wcwidth(ch);
+  if (width == 0) {
+    return;
+  } else if (width < 0) {
+    width = 1;
+  }
+
+  /* A wide character can't fit a screen 1 column wide, so a replacement
+     character takes its place */
+  if (width == 2 && _cols < 2) {
+    ch = 0xfffd;
+    width = 1;
+  }
+
+  if (_wrapPending && _autowrap) {
+    _cursor.col = 0;
+    lineFeed();
+  }
+
+  if (width == 2 && _cursor.col == _cols - 1) {
+    if (!_autowrap) {
+      return;
+    }
+    at(_cursor.row, _cursor.col) = blank();
+    _cursor.col = 0;
+    lineFeed();
+  }
+
+  int row = _cursor.row;
+  int col = _cursor.col;
+  Cell *line = &at(row, 0);
+
+  if (_insertMode) {
+    std::copy_backward(line + col, line + _cols - width, line + _cols);
+  }
+
+  /* Never leave half of a wide character behind */
+  if (!line[col].ch && col > 0) {
+    line[col - 1] = blank();
+  }
+  if (col + width < _cols && !line[col + width].ch) {
+    line[col + width] = blank();
+  }
+
+  line[col] = {ch, _cursor.attr};
+  if (width == 2) {
+    line[col + 1] = {0, _cursor.attr};
+  }
+
+  _cursor.col += width;
+  if (_cursor.col >= _cols) {
+    _cursor.col = _cols - 1;
+    _wrapPending = _autowrap;
+  }
+}
+
+/* Equivalent to print() for each byte of a printable ASCII run, but filling
+   a row at a time */
+void Screen::printASCII(const char *buf, size_t len)
+{
+  if (_insertMode || _cursor.charsets[_cursor.shift] == '0') {
+    for (size_t i=0; i<len; ++i) {
+      print((unsigned char) buf[i]);
+    }
+    return;
+  }
+
+  while (len) {
+    if (_wrapPending && _autowrap) {
+      _cursor.col = 0;
+      lineFeed();
+    }
+
+    int col = _cursor.col;
+    size_t n = std::min(len, (size_t) (_cols - col));
+    Cell *line = &at(_cursor.row, 0);
+
+    /* Never leave half of a wide character behind */
+    if (!line[col].ch && col > 0) {
+      line[col - 1] = blank();
+    }
+    if (col + n < (size_t) _cols && !line[col + n].ch) {
+      line[col + n] = blank();
+    }
+
+    for (size_t i=0; i<n; ++i) {
+      line[col + i] = {(unsigned char) buf[i], _cursor.attr};
+    }
+    buf += n;
+    len -= n;
+
+    _cursor.col += n;
+    if (_cursor.col >= _cols) {
+      _cursor.col = _cols - 1;
+      _wrapPending = _autowrap;
+
+      /* Without autowrap the rest overwrite the last column in turn */
+      if (!_autowrap && len) {
+        line[_cols - 1] = {(unsigned char) buf[len - 1], _cursor.attr};
+        len = 0;
+      }
+    }
+  }
+}
+
+void Screen::control(unsigned char c)
+{
+  switch (c) {
+  case '\b':
+    moveTo(_cursor.row, _cursor.col - 1);
+    break;
+  case '\t': {
+    int col = _cursor.col + 1;
+    while (col < _cols - 1 && !_tabs[col]) {
+      ++col;
+    }
+    moveTo(_cursor.row, col);
+    break;
+  }
+  case '\n':
+  case '\v':
+  case '\f':
+    lineFeed();
+    break;
+  case '\r':
+    moveTo(_cursor.row, 0);
+    break;
+  case 0x0e:
+    _cursor.shift = 1;
+    break;
+  case 0x0f:
+    _cursor.shift = 0;
+    break;
+  }
+}
+
+void Screen::escDispatch(unsigned char c)
+{
+  if (_intermediate == '(' || _intermediate == ')') {
+    _cursor.charsets[_intermediate == ')'] = c == '0' ? '0' : 'B';
+    return;
+  } else if (_intermediate == '#' && c == '8') {
+    /* DECALN fills the screen with Es */
+    for (Cell &cell : _cells) {
+      cell = {'E', DEFAULT_ATTR};
+    }
+    return;
+  } else if (_intermediate) {
+    return;
+  }
+
+  switch (c) {
+  case '7':
+    saveCursor();
+    break;
+  case '8':
+    restoreCursor();
+    break;
+  case 'D':
+    lineFeed();
+    break;
+  case 'E':
+    _cursor.col = 0;
+    lineFeed();
+    break;
+  case 'M':
+    reverseIndex();
+    break;
+  case 'H':
+    _tabs[_cursor.col] = true;
+    break;
+  case 'c':
+    reset();
+    break;
+  case '=':
+    _appKeypad = true;
+    break;
+  case '>':
+    _appKeypad = false;
+    break;
+  }
+}
+
+void Screen::csiDispatch(unsigned char c)
+{
+  if (_prefix == '?') {
+    if (c == 'h' || c == 'l') {
+      for (int mode : _params) {
+        setPrivateMode(mode, c == 'h');
+      }
+    } else if (c == 'n') {
+      report(_prefix, c);
+    }
+    return;
+  } else if (_prefix) {
+    return;
+  }
+
+  if (_intermediate == '!' && c == 'p') {
+    /* DECSTR soft reset */
+    _autowrap = true;
+    _insertMode = false;
+    _cursorVisible = true;
+    _cursor.originMode = false;
+    _cursor.attr = DEFAULT_ATTR;
+    _top = 0;
+    _bottom = _rows - 1;
+    _savedCursor = _cursor;
+    return;
+  } else if (_intermediate) {
+    return;
+  }
+
+  int n = param(0, 1);
+  int row = _cursor.row;
+  int col = _cursor.col;
+
+  switch (c) {
+  case 'A':
+    moveTo(std::max(row - n, row >= _top ? _top : 0), col);
+    break;
+  case 'B':
+  case 'e':
+    moveTo(std::min(row + n, row <= _bottom ? _bottom : _rows - 1), col);
+    break;
+  case 'C':
+  case 'a':
+    moveTo(row, col + n);
+    break;
+  case 'D':
+    moveTo(row, col - n);
+    break;
+  case 'E':
+    moveTo(std::min(row + n, row <= _bottom ? _bottom : _rows - 1), 0);
+    break;
+  case 'F':
+    moveTo(std::max(row - n, row >= _top ? _top : 0), 0);
+    break;
+  case 'G':
+  case '`':
+    moveTo(row, n - 1);
+    break;
+  case 'H':
+  case 'f':
+  case 'd': {
+    int toRow = n - 1;
+    int toCol = c == 'd' ? col : param(1, 1) - 1;
+    if (_cursor.originMode) {
+      toRow = std::min(toRow + _top, _bottom);
+    }
+    moveTo(toRow, toCol);
+    break;
+  }
+  case 'J': {
+    int mode = param(0, 0);
+    if (mode == 0) {
+      eraseCells(row, col, _cols);
+      for (int r=row+1; r<_rows; ++r) {
+        eraseCells(r, 0, _cols);
+      }
+    } else if (mode == 1) {
+      for (int r=0; r<row; ++r) {
+        eraseCells(r, 0, _cols);
+      }
+      eraseCells(row, 0, col + 1);
+    } else if (mode == 2 || mode == 3) {
+      for (int r=0; r<_rows; ++r) {
+        eraseCells(r, 0, _cols);
+      }
+    }
+    _wrapPending = false;
+    break;
+  }
+  case 'K': {
+    int mode = param(0, 0);
+    if (mode == 0) {
+      eraseCells(row, col, _cols);
+    } else if (mode == 1) {
+      eraseCells(row, 0, col + 1);
+    } else if (mode == 2) {
+      eraseCells(row, 0, _cols);
+    }
+    _wrapPending = false;
+    break;
+  }
+  case 'L':
+    if (row >= _top && row <= _bottom) {
+      scrollDown(row, _bottom, n);
+      moveTo(row, 0);
+    }
+    break;
+  case 'M':
+    if (row >= _top && row <= _bottom) {
+      scrollUp(row, _bottom, n);
+      moveTo(row, 0);
+    }
+    break;
+  case '@': {
+    Cell *line = &at(row, 0);
+    n = std::min(n, _cols - col);
+    std::copy_backward(line + col, line + _cols - n, line + _cols);
+    eraseCells(row, col, col + n);
+    _wrapPending = false;
+    break;
+  }
+  case 'P': {
+    Cell *line = &at(row, 0);
+    n = std::min(n, _cols - col);
+    std::copy(line + col + n, line + _cols, line + col);
+    eraseCells(row, _cols - n, _cols);
+    _wrapPending = false;
+    break;
+  }
+  case 'X':
+    eraseCells(row, col, std::min(col + n, _cols));
+    _wrapPending = false;
+    break;
+  case 'S':
+    scrollUp(_top, _bottom, n);
+    break;
+  case 'T':
+    if (_params.size() <= 1) {
+      scrollDown(_top, _bottom, n);
+    }
+    break;
+  case 'r': {
+    int top = param(0, 1) - 1;
+    int bottom = param(1, _rows) - 1;
+    if (top < bottom && bottom < _rows) {
+      _top = top;
+      _bottom = bottom;
+      moveTo(_cursor.originMode ? _top : 0, 0);
+    }
+    break;
+  }
+  case 'm':
+    selectGraphicRendition();
+    break;
+  case 'h':
+  case 'l':
+    for (int mode : _params) {
+      setMode(mode, c == 'h');
+    }
+    break;
+  case 's':
+    saveCursor();
+    break;
+  case 'u':
+    restoreCursor();
+    break;
+  case 'g': {
+    int mode = param(0, 0);
+    if (mode == 0) {
+      _tabs[col] = false;
+    } else if (mode == 3) {
+      _tabs.assign(_cols, false);
+    }
+    break;
+  }
+  case 'n':
+  case 'c':
+  case 't':
+    report(_prefix, c);
+    break;
+  }
+}
+
+/* Answer a query as the real terminal would have. The cursor position is
+   relative to the scroll region in origin mode */
+void Screen::report(char prefix, unsigned char c)
+{
+  int mode = param(0, 0);
+  int row = _cursor.row - (_cursor.originMode ? _top : 0) + 1;
+  std::string pos = std::to_string(row) + ";" +
+    std::to_string(_cursor.col + 1) + "R";
+
+  if (c == 'n' && mode == 5 && !prefix) {
+    _replies += "\x1b[0n";
+  } else if (c == 'n' && mode == 6) {
+    _replies += std::string("\x1b[") + (prefix ? "?" : "") + pos;
+  } else if (c == 'c' && !mode) {
+    _replies += "\x1b[?1;2c";
+  } else if (c == 't' && mode == 18) {
+    _replies += "\x1b[8;" + std::to_string(_rows) + ";" +
+      std::to_string(_cols) + "t";
+  }
+}
+
+std::string Screen::takeReplies()
+{
+  std::string res;
+  res.swap(_replies);
+  return res;
+}
+
+void Screen::selectGraphicRendition()
+{
+  if (_params.empty()) {
+    _cursor.attr = DEFAULT_ATTR;
+    return;
+  }
+
+  Attr &attr = _cursor.attr;
+  for (size_t i=0; i<_params.size(); ++i) {
+    int p = _params[i];
+
+    if (p == 38 || p == 48) {
+      uint32_t color = COLOR_DEFAULT;
+      if (i + 2 < _params.size() && _params[i + 1] == 5) {
+        color = COLOR_PALETTE | (_params[i + 2] & 0xff);
+        i += 2;
+      } else if (i + 4 < _params.size() && _params[i + 1] == 2) {
+        color = COLOR_RGB | (_params[i + 2] & 0xff) << 16 |
+          (_params[i + 3] & 0xff) << 8 | (_params[i + 4] & 0xff);
+        i += 4;
+      } else {
+        break;
+      }
+      (p == 38 ? attr.fg : attr.bg) = color;
+      continue;
+    }
+
+    switch (p) {
+    case 0: attr = DEFAULT_ATTR; break;
+    case 1: attr.flags |= ATTR_BOLD; break;
+    case 2: attr.flags |= ATTR_DIM; break;
+    case 3: attr.flags |= ATTR_ITALIC; break;
+    case 4: attr.flags |= ATTR_UNDERLINE; break;
+    case 5: attr.flags |= ATTR_BLINK; break;
+    case 7: attr.flags |= ATTR_REVERSE; break;
+    case 8: attr.flags |= ATTR_HIDDEN; break;
+    case 9: attr.flags |= ATTR_STRIKE; break;
+    case 22: attr.flags &= ~(ATTR_BOLD | ATTR_DIM); break;
+    case 23: attr.flags &= ~ATTR_ITALIC; break;
+    case 24: attr.flags &= ~ATTR_UNDERLINE; break;
+    case 25: attr.flags &= ~ATTR_BLINK; break;
+    case 27: attr.flags &= ~ATTR_REVERSE; break;
+    case 28: attr.flags &= ~ATTR_HIDDEN; break;
+    case 29: attr.flags &= ~ATTR_STRIKE; break;
+    case 39: attr.fg = COLOR_DEFAULT; break;
+    case 49: attr.bg = COLOR_DEFAULT; break;
+    default:
+      if (p >= 30 && p <= 37) {
+        attr.fg = COLOR_PALETTE | (p - 30);
+      } else if (p >= 40 && p <= 47) {
+        attr.bg = COLOR_PALETTE | (p - 40);
+      } else if (p >= 90 && p <= 97) {
+        attr.fg = COLOR_PALETTE | (p - 90 + 8);
+      } else if (p >= 100 && p <= 107) {
+        attr.bg = COLOR_PALETTE | (p - 100 + 8);
+      }
+    }
+  }
+}
+
+void Screen::setMode(int mode, bool on)
+{
+  if (mode == 4) {
+    _insertMode = on;
+  }
+}
+
+void Screen::setPrivateMode(int mode, bool on)
+{
+  switch (mode) {
+  case 6:
+    _cursor.originMode = on;
+    moveTo(on ? _top : 0, 0);
+    break;
+  case 7:
+    _autowrap = on;
+    break;
+  case 25:
+    _cursorVisible = on;
+    break;
+  case 47:
+    switchScreen(on, false);
+    break;
+  case 1047:
+    switchScreen(on, true);
+    break;
+  case 1048:
+    if (on) {
+      _altSavedCursor = _cursor;
+    } else {
+      _cursor = _altSavedCursor;
+      moveTo(_cursor.row, _cursor.col);
+    }
+    break;
+  case 1049:
+    if (on) {
+      _altSavedCursor = _cursor;
+      switchScreen(true, true);
+    } else {
+      switchScreen(false, false);
+      _cursor = _altSavedCursor;
+      moveTo(_cursor.row, _cursor.col);
+    }
+    break;
+  default:
+    _passModes[mode] = on;
+  }
+}
+
+void Screen::switchScreen(bool alt, bool clear)
+{
+  if (alt != _altScreen) {
+    _cells.swap(_otherCells);
+    _lines.swap(_otherLines);
+    _altScreen = alt;
+  }
+  if (alt && clear) {
+    _cells.assign(_rows * _cols, DEFAULT_CELL);
+  }
+  _wrapPending = false;
+}
+
+/* Parameters which are missing or 0 take the fallback */
+int Screen::param(size_t i, int fallback) const
+{
+  return i < _params.size() && _params[i] ? _params[i] : fallback;
+}
+
+/* Erased cells take the current background (xterm's back colour erase) */
+Cell Screen::blank() const
+{
+  return {' ', {COLOR_DEFAULT, _cursor.attr.bg, 0}};
+}
+
+Cell &Screen::at(int row, int col)
+{
+  return _cells[_lines[row] * _cols + col];
+}
+
+/* Blank the cells [from, to) of a row */
+void Screen::eraseCells(int row, int from, int to)
+{
+  std::fill(&at(row, 0) + from, &at(row, 0) + to, blank());
+}
+
+/* Move rows top + n to bottom up by n, blanking the rows uncovered. The rows
+   scrolled off are reused for them, so only their cells are written */
+void Screen::scrollUp(int top, int bottom, int n)
+{
+  n = std::min(n, bottom - top + 1);
+  std::rotate(_lines.begin() + top, _lines.begin() + top + n,
+    _lines.begin() + bottom + 1);
+  for (int r=bottom-n+1; r<=bottom; ++r) {
+    eraseCells(r, 0, _cols);
+  }
+}
+
+void Screen::scrollDown(int top, int bottom, int n)
+{
+  n = std::min(n, bottom - top + 1);
+  std::rotate(_lines.begin() + top, _lines.begin() + bottom + 1 - n,
+    _lines.begin() + bottom + 1);
+  for (int r=top; r<top+n; ++r) {
+    eraseCells(r, 0, _cols);
+  }
+}
+
+/* Scrolls the region when at its bottom margin, otherwise moves down */
+void Screen::lineFeed()
+{
+  _wrapPending = false;
+  if (_cursor.row == _bottom) {
+    scrollUp(_top, _bottom, 1);
+  } else if (_cursor.row < _rows - 1) {
+    ++_cursor.row;
+  }
+}
+
+void Screen::reverseIndex()
+{
+  _wrapPending = false;
+  if (_cursor.row == _top) {
+    scrollDown(_top, _bottom, 1);
+  } else if (_cursor.row > 0) {
+    --_cursor.row;
+  }
+}
+
+void Screen::moveTo(int row, int col)
+{
+  _cursor.row = std::max(0, std::min(row, _rows - 1));
+  _cursor.col = std::max(0, std::min(col, _cols - 1));
+  _wrapPending = false;
+}
+
+void Screen::saveCursor()
+{
+  _savedCursor = _cursor;
+}
+
+void Screen::restoreCursor()
+{
+  _cursor = _savedCursor;
+  moveTo(_cursor.row, _cursor.col);
+}
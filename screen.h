@@ -0,0 +1,182 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Graphic rendition flags */
+const uint8_t ATTR_BOLD = 1 << 0;
+const uint8_t ATTR_DIM = 1 << 1;
+const uint8_t ATTR_ITALIC = 1 << 2;
+const uint8_t ATTR_UNDERLINE = 1 << 3;
+const uint8_t ATTR_BLINK = 1 << 4;
+const uint8_t ATTR_REVERSE = 1 << 5;
+const uint8_t ATTR_HIDDEN = 1 << 6;
+const uint8_t ATTR_STRIKE = 1 << 7;
+
+/* A colour is the terminal's default, an index into the 256 colour palette or
+   a 24-bit RGB value, distinguished by the top byte */
+const uint32_t COLOR_DEFAULT = 0;
+const uint32_t COLOR_PALETTE = 1 << 24;
+const uint32_t COLOR_RGB = 2 << 24;
+
+struct Attr {
+  uint32_t fg;
+  uint32_t bg;
+  uint8_t flags;
+
+  bool operator==(const Attr &other) const
+  {
+    return fg == other.fg && bg == other.bg && flags == other.flags;
+  }
+
+  bool operator!=(const Attr &other) const
+  {
+    return !(*this == other);
+  }
+};
+
+/* ch is a Unicode code point, or 0 for the right half of a wide character */
+struct Cell {
+  uint32_t ch;
+  Attr attr;
+
+  bool operator==(const Cell &other) const
+  {
+    return ch == other.ch && attr == other.attr;
+  }
+
+  bool operator!=(const Cell &other) const
+  {
+    return !(*this == other);
+  }
+};
+
+const Attr DEFAULT_ATTR = {COLOR_DEFAULT, COLOR_DEFAULT, 0};
+const Cell DEFAULT_CELL = {' ', DEFAULT_ATTR};
+
+/* Position and rendition which DECSC/DECRC save and restore */
+struct Cursor {
+  int row;
+  int col;
+  Attr attr;
+  bool originMode;
+  char charsets[2];
+  int shift;
+};
+
+/* The visible state of a VT100/xterm-like terminal, kept up to date by feeding
+   it everything a window outputs
+
+   The parser is a state machine along the lines of Paul Williams' DEC parser,
+   decoding UTF-8 in the ground state, with a vectorized fast path for runs of
+   printable ASCII. It tracks the cell grid (characters and renditions), the
+   cursor, the scroll region, the alternate screen and the modes which change
+   how the real terminal interprets later output or encodes keys
+
+   Output is drawn from the model rather than passed through, so no real
+   terminal ever sees the window's queries. The ones programs wait for are
+   answered from the model instead: status and cursor position reports (DSR,
+   DECXCPR), device attributes (DA, as a VT100) and the text area size
+   (CSI 18 t). Replies collect until takeReplies(), for writing to the
+   window's input. Colour queries (OSC 10/11) go unanswered, since only the
+   real terminal knows its colours
+
+   A Renderer draws it onto a real terminal, so the cost of switching windows
+   is bounded by the screen size rather than scrollback */
+class Screen {
+public:
+  Screen(int rows, int cols);
+
+  void feed(const char *buf, size_t len);
+
+  int rows() const;
+  int cols() const;
+  const Cell &cell(int row, int col) const;
+  const Cursor &cursor() const;
+  bool cursorVisible() const;
+  bool appKeypad() const;
+  const std::map<int, bool> &passModes() const;
+  std::string takeReplies();
+
+private:
+  enum class State {
+    GROUND,
+    ESCAPE,
+    ESCAPE_INTERMEDIATE,
+    CSI,
+    STRING
+  };
+
+  void reset();
+  void feedByte(unsigned char c);
+  void print(uint32_t ch);
+  void printASCII(const char *buf, size_t len);
+  void control(unsigned char c);
+  void escDispatch(unsigned char c);
+  void csiDispatch(unsigned char c);
+  void selectGraphicRendition();
+  void setMode(int mode, bool on);
+  void setPrivateMode(int mode, bool on);
+  void switchScreen(bool alt, bool clear);
+  void report(char prefix, unsigned char c);
+
+  int param(size_t i, int fallback) const;
+  Cell blank() const;
+  Cell &at(int row, int col);
+  void eraseCells(int row, int from, int to);
+  void scrollUp(int top, int bottom, int n);
+  void scrollDown(int top, int bottom, int n);
+  void lineFeed();
+  void reverseIndex();
+  void moveTo(int row, int col);
+  void saveCursor();
+  void restoreCursor();
+
+  int _rows;
+  int _cols;
+  std::vector<Cell> _cells;
+
+  /* Where each row's cells start in _cells, in rows, so scrolling rotates
+     these rather than moving every cell of the region */
+  std::vector<int> _lines;
+
+  /* The grid which isn't visible, i.e. the main screen while the alternate one
+     is active */
+  std::vector<Cell> _otherCells;
+  std::vector<int> _otherLines;
+  bool _altScreen;
+
+  Cursor _cursor;
+  Cursor _savedCursor;
+  Cursor _altSavedCursor;
+  bool _wrapPending;
+  int _top;
+  int _bottom;
+  std::vector<bool> _tabs;
+
+  bool _autowrap;
+  bool _insertMode;
+  bool _cursorVisible;
+  bool _appKeypad;
+
+  /* Private modes which don't affect the model but must be replayed to the
+     real terminal, e.g. application cursor keys or mouse reporting */
+  std::map<int, bool> _passModes;
+
+  std::string _replies;
+
+  State _state;
+  std::vector<int> _params;
+  char _prefix;
+  char _intermediate;
+  uint32_t _utf8;
+  int _utf8Left;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "scrollback.h"
+#include "compressedlog.h"
+#include "segmentlog.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+
+Scrollback::Scrollback(size_t capacity, const std::string &spillDir):
+  _capacity(capacity),
+  _ring(std::min(capacity, HOT_CAPACITY)),
+  _tail(0),
+  _reserved(nullptr)
+{
+  if (capacity <= _ring.capacity()) {
+    return;
+  } else if (spillDir.empty()) {
+    _cold.reset(new CompressedLog(capacity));
+  } else {
+    _cold.reset(new SegmentLog(capacity, spillDir));
+  }
+}
+
+void Scrollback::write(const char *from, size_t len)
+{
+  _ring.write(from, len);
+  append(from, len);
+}
+
+/* Space at the tail to write up to len bytes into, see SharedRing::reserve().
+   commit() must follow before anything else is written */
+char *Scrollback::reserve(size_t &len)
+{
+  _reserved = _ring.reserve(len);
+  return _reserved;
+}
+
+/* Take in len bytes written into the reserved space, returning where they
+   are. They stay valid until the ring wraps around to them */
+const char *Scrollback::commit(size_t len)
+{
+  _ring.commit(len);
+  append(_reserved, len);
+  return _reserved;
+}
+
+/* Everything but the ring follows bytes it has just taken in. Only those
+   which will still be retained afterwards need indexing */
+void Scrollback::append(const char *from, size_t len)
+{
+  size_t kept = std::min(len, _capacity);
+
+  if (_cold) {
+    _cold->append(from, len);
+  }
+  _index.append(_tail + (len - kept), from + (len - kept), kept);
+  _trigrams.append(_tail + (len - kept), from + (len - kept), kept);
+  _tail += len;
+  _index.trim(head());
+  _trigrams.trim(head());
+}
+
+size_t Scrollback::size() const
+{
+  return _tail - head();
+}
+
+size_t Scrollback::capacity() const
+{
+  return _capacity;
+}
+
+/* The cold store may hold less than capacity, e.g. after running out of
+   disk */
+uint64_t Scrollback::head() const
+{
+  return _cold ? std::min(_cold->head(), ringHead()) : ringHead();
+}
+
+uint64_t Scrollback::tail() const
+{
+  return _tail;
+}
+
+size_t Scrollback::lines() const
+{
+  return _index.lines();
+}
+
+/* Seek to the k-th oldest full line, see LineIndex */
+uint64_t Scrollback::lineStart(size_t k) const
+{
+  return _index.lineStart(k);
+}
+
+uint64_t Scrollback::lastLines(size_t n) const
+{
+  return _index.lastLines(n, head(), _tail);
+}
+
+/* See LineIndex::lineAt() */
+size_t Scrollback::lineAt(uint64_t pos) const
+{
+  return _index.lineAt(pos);
+}
+
+/* Spans covering retained bytes from absolute offset from, which point
+   straight into memory (or the cold store's mapping or cache) and are valid
+   until the next write() or read. Bytes from memory run to tail(), as with
+   SharedRing::segments(), while a span from the cold store ends with its
+   segment or block, so callers continue from the end of the last span until
+   tail() */
+int Scrollback::segments(struct iovec iov[2], uint64_t from) const
+{
+  from = std::max(from, head());
+  if (from >= ringHead()) {
+    return _ring.segments(iov, from - ringHead());
+  }
+
+  const char *ptr;
+  size_t len = _cold->span(from, &ptr);
+  if (!len) {
+    return 0;
+  }
+  iov[0].iov_base = (void *) ptr;
+  iov[0].iov_len = len;
+  return 1;
+}
+
+/* Copy up to len retained bytes from absolute offset from, wherever they are
+   kept. Returns the number copied */
+size_t Scrollback::read(uint64_t from, char *into, size_t len) const
+{
+  size_t copied = 0;
+  from = std::max(from, head());
+
+  while (copied < len) {
+    struct iovec iov[2];
+    int n = segments(iov, from + copied);
+    if (!n) {
+      break;
+    }
+
+    for (int i=0; i<n && copied<len; ++i) {
+      size_t blockLen = std::min(len - copied, iov[i].iov_len);
+      memcpy(into + copied, iov[i].iov_base, blockLen);
+      copied += blockLen;
+    }
+  }
+
+  return copied;
+}
+
+/* See SharedRing::shareFd() */
+int Scrollback::shareFd() const
+{
+  return _ring.shareFd();
+}
+
+/* Offsets of up to max occurrences of query, newest first, ignoring ASCII
+   case. Each candidate block is read with enough of the next to finish a
+   match starting at its end, and only matches starting within it count */
+std::vector<uint64_t> Scrollback::find(const std::string &query,
+  size_t max) const
+{
+  std::vector<uint64_t> res;
+  if (query.empty() || query.size() > INDEX_BLOCK) {
+    return res;
+  }
+
+  std::string needle(query);
+  for (char &c : needle) {
+    c = foldCase(c);
+  }
+
+  std::vector<uint64_t> blocks = _trigrams.candidates(needle, head(), _tail);
+  std::string text;
+  std::vector<uint64_t> found;
+
+  for (auto it=blocks.rbegin(); it!=blocks.rend() && res.size()<max; ++it) {
+    uint64_t start = std::max(*it, head());
+    uint64_t end = std::min(*it + INDEX_BLOCK + needle.size() - 1, _tail);
+    if (start >= end) {
+      continue;
+    }
+
+    text.resize(end - start);
+    text.resize(read(start, &text[0], text.size()));
+    for (char &c : text) {
+      c = foldCase(c);
+    }
+
+    found.clear();
+    for (size_t pos = text.find(needle);
+         pos != std::string::npos && start + pos < *it + INDEX_BLOCK;
+         pos = text.find(needle, pos + 1)) {
+      found.push_back(start + pos);
+    }
+    for (auto hit=found.rbegin(); hit!=found.rend() && res.size()<max; ++hit) {
+      res.push_back(*hit);
+    }
+  }
+
+  return res;
+}
+
+uint64_t Scrollback::ringHead() const
+{
+  return _tail - _ring.size();
+}
+
+uint64_t Scrollback::bytesIn() const
+{
+  return _tail;
+}
+
+size_t Scrollback::storedBytes() const
+{
+  return _ring.capacity() + (_cold ? _cold->storedBytes() : 0);
+}
+
+size_t Scrollback::indexBytes() const
+{
+  return _trigrams.memoryBytes();
+}
+
+size_t Scrollback::memoryBytes() const
+{
+  return _ring.residentBytes() + (_cold ? _cold->memoryBytes() : 0) +
+    _trigrams.memoryBytes();
+}
+
+/* Bring the hot bytes back from the cold store after shed() released them,
+   e.g. before the ring is shared, since a reader of it sees only them */
+void Scrollback::reload()
+{
+  size_t len = std::min(size(), _ring.capacity());
+  if (_ring.size() || !len) {
+    return;
+  }
+
+  std::string bytes(len, '\0');
+  if (read(_tail - len, &bytes[0], len) == len) {
+    _ring.refill(bytes.data(), len);
+  }
+}
+
+/* Free at least bytes of memory if possible, returning how much was freed.
+   The hot bytes go first, since the cold store has a copy, then the oldest
+   history. Without a cold store there is nothing to spare */
+size_t Scrollback::shed(size_t bytes)
+{
+  if (!_cold) {
+    return 0;
+  }
+
+  size_t freed = _ring.residentBytes();
+  _ring.release();
+  if (freed < bytes) {
+    freed += _cold->shed(bytes - freed);
+  }
+
+  _index.trim(head());
+  _trigrams.trim(head());
+  return freed;
+}
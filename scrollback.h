@@ -0,0 +1,86 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include "coldstore.h"
+#include "lineindex.h"
+#include "sharedring.h"
+#include "trigramindex.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/* Most recent output kept in plain memory, the rest going to a ColdStore */
+const size_t HOT_CAPACITY = 64 * 1024;
+
+/* The last N bytes output by a window, plus an index of where its lines start
+
+   Positions are absolute: head() is the offset of the oldest retained byte and
+   tail() the offset of the next byte to be written, so tail() - head() is
+   size(). Replay can therefore begin on a line boundary instead of partway
+   through an escape sequence or a multibyte character
+
+   Only the last HOT_CAPACITY bytes are kept in plain memory. Everything is
+   also appended to a ColdStore, which serves reads of anything older: a
+   SegmentLog given a spill directory, otherwise a CompressedLog. The hot
+   bytes live in a SharedRing, so shareFd() lets another process map them
+   read-only, and reserve() lets output be read straight into it, commit()
+   then taking it in like write() without copying it
+
+   find() looks up case-insensitive substrings through a TrigramIndex of the
+   retained bytes, so only the blocks which may contain one are read back
+
+   bytesIn() counts everything ever written, and storedBytes() what the
+   retained size() bytes take up, so their ratio shows what compression or
+   spilling saves. memoryBytes() is the part of that (and of the indexes)
+   held in memory, which shed() trims when memory is short */
+class Scrollback {
+public:
+  Scrollback(size_t capacity, const std::string &spillDir="");
+
+  void write(const char *from, size_t len);
+  char *reserve(size_t &len);
+  const char *commit(size_t len);
+
+  size_t size() const;
+  size_t capacity() const;
+  uint64_t head() const;
+  uint64_t tail() const;
+
+  size_t lines() const;
+  uint64_t lineStart(size_t k) const;
+  uint64_t lastLines(size_t n) const;
+  size_t lineAt(uint64_t pos) const;
+
+  int segments(struct iovec iov[2], uint64_t from) const;
+  size_t read(uint64_t from, char *into, size_t len) const;
+  int shareFd() const;
+  void reload();
+
+  std::vector<uint64_t> find(const std::string &query, size_t max) const;
+
+  uint64_t bytesIn() const;
+  size_t storedBytes() const;
+  size_t indexBytes() const;
+  size_t memoryBytes() const;
+  size_t shed(size_t bytes);
+
+private:
+  uint64_t ringHead() const;
+  void append(const char *from, size_t len);
+
+  size_t _capacity;
+  SharedRing _ring;
+  std::unique_ptr<ColdStore> _cold;
+  LineIndex _index;
+  TrigramIndex _trigrams;
+  uint64_t _tail;
+  char *_reserved;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "segmentlog.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+SegmentLog::SegmentLog(size_t capacity, const std::string &dir,
+  size_t segmentSize):
+  _capacity(capacity),
+  _dir(dir),
+  _segmentSize(segmentSize),
+  _fd(-1),
+  _fileSize(0),
+  _head(0),
+  _tail(0),
+  _writeMap(nullptr),
+  _readStart(0),
+  _readMap(nullptr)
+{}
+
+SegmentLog::SegmentLog(SegmentLog &&other):
+  _capacity(other._capacity),
+  _dir(std::move(other._dir)),
+  _segmentSize(other._segmentSize),
+  _segments(std::move(other._segments)),
+  _fd(other._fd),
+  _fileSize(other._fileSize),
+  _freeSlots(std::move(other._freeSlots)),
+  _head(other._head),
+  _tail(other._tail),
+  _writeMap(other._writeMap),
+  _readStart(other._readStart),
+  _readMap(other._readMap)
+{
+  other._segments.clear();
+  other._fd = -1;
+  other._writeMap = nullptr;
+  other._readMap = nullptr;
+}
+
+SegmentLog::~SegmentLog()
+{
+  clear();
+}
+
+/* Bytes which would fall behind capacity straight away are skipped, and so
+   is everything once a segment can't be created */
+void SegmentLog::append(const char *from, size_t len)
+{
+  if (len > _capacity) {
+    clear();
+    _tail += len - _capacity;
+    from += len - _capacity;
+    len = _capacity;
+  }
+
+  while (len) {
+    if (_segments.empty() || _tail == _segments.back().start + _segmentSize) {
+      if (!addSegment()) {
+        clear();
+        _tail += len;
+        break;
+      }
+    }
+
+    size_t pos = _tail - _segments.back().start;
+    size_t blockLen = std::min(len, _segmentSize - pos);
+    memcpy(_writeMap + pos, from, blockLen);
+
+    from += blockLen;
+    len -= blockLen;
+    _tail += blockLen;
+  }
+
+  _head = std::max(_head, _tail > _capacity ? _tail - _capacity : 0);
+  if (_segments.empty()) {
+    _head = _tail;
+  }
+  while (_segments.size() > 1 && _segments[1].start <= _head) {
+    dropSegment();
+  }
+}
+
+uint64_t SegmentLog::head() const
+{
+  return _head;
+}
+
+uint64_t SegmentLog::tail() const
+{
+  return _tail;
+}
+
+/* Whole segments are allocated on disk */
+size_t SegmentLog::storedBytes() const
+{
+  return _segments.size() * _segmentSize;
+}
+
+size_t SegmentLog::memoryBytes() const
+{
+  return 0;
+}
+
+size_t SegmentLog::shed(size_t)
+{
+  unmap(_readMap);
+  return 0;
+}
+
+/* Point ptr at the byte at absolute offset from, returning how many bytes
+   follow it contiguously (up to the end of its segment), or 0 if it isn't
+   retained. ptr is valid until the next call or append() */
+size_t SegmentLog::span(uint64_t from, const char **ptr) const
+{
+  if (from < _head || from >= _tail) {
+    return 0;
+  }
+
+  const Segment &segment =
+    _segments[(from - _segments.front().start) / _segmentSize];
+  char *base = _writeMap;
+
+  if (&segment != &_segments.back()) {
+    if (!_readMap || _readStart != segment.start) {
+      unmap(_readMap);
+      _readMap = map(segment, PROT_READ);
+      _readStart = segment.start;
+    }
+    base = _readMap;
+  }
+
+  if (!base) {
+    return 0;
+  }
+
+  size_t pos = from - segment.start;
+  *ptr = base + pos;
+  return std::min((uint64_t) _segmentSize, _tail - segment.start) - pos;
+}
+
+/* A new segment takes a free slot, or else extends the file. Its blocks are
+   allocated up front, since writing through a mapping to a hole on a full
+   disk would raise SIGBUS rather than fail */
+bool SegmentLog::addSegment()
+{
+  if (_fd == -1 &&
+      (_fd = open(_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1) {
+    return false;
+  }
+
+  Segment segment = {_freeSlots.empty() ? _fileSize : _freeSlots.back(),
+    _tail};
+  char *addr = nullptr;
+  if (posix_fallocate(_fd, segment.pos, _segmentSize) != 0 ||
+      !(addr = map(segment, PROT_READ | PROT_WRITE))) {
+    return false;
+  }
+
+  if (segment.pos == _fileSize) {
+    _fileSize += _segmentSize;
+  } else {
+    _freeSlots.pop_back();
+  }
+
+  /* The previous segment is full, and only read from now on */
+  unmap(_writeMap);
+  _writeMap = addr;
+  _segments.push_back(segment);
+  return true;
+}
+
+/* The slot's blocks go back to the filesystem until it is reused. Where
+   holes can't be punched they are simply kept */
+void SegmentLog::dropSegment()
+{
+  const Segment &segment = _segments.front();
+  if (_readMap && _readStart == segment.start) {
+    unmap(_readMap);
+  }
+  fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, segment.pos,
+    _segmentSize);
+  _freeSlots.push_back(segment.pos);
+  _segments.pop_front();
+}
+
+void SegmentLog::clear()
+{
+  unmap(_writeMap);
+  unmap(_readMap);
+  if (_fd != -1) {
+    close(_fd);
+    _fd = -1;
+  }
+  _fileSize = 0;
+  _freeSlots.clear();
+  _segments.clear();
+  _head = _tail;
+}
+
+char *SegmentLog::map(const Segment &segment, int prot) const
+{
+  void *addr = mmap(NULL, _segmentSize, prot, MAP_SHARED, _fd, segment.pos);
+  return addr == MAP_FAILED ? nullptr : (char *) addr;
+}
+
+void SegmentLog::unmap(char *&addr) const
+{
+  if (addr) {
+    munmap(addr, _segmentSize);
+    addr = nullptr;
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef SEGMENTLOG_H
+#define SEGMENTLOG_H
+
+#include "coldstore.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Default size of each segment in a SegmentLog */
+const size_t SEGMENT_SIZE = 4 * 1024 * 1024;
+
+/* An append-only log of the last capacity bytes of a stream, kept on disk in
+   fixed-size segments which are memory-mapped
+
+   Only the segment being appended to stays mapped. Full ones are unmapped,
+   leaving their pages to the page cache, and are mapped again on demand when
+   read, so memory use doesn't grow with capacity. Segments whose bytes have
+   all fallen behind capacity are deleted from the front
+
+   Offsets are absolute, as in Scrollback. The segments are slots in one file
+   per log, so a window holds a single descriptor however large its capacity.
+   A deleted segment's blocks are punched out of the file and its slot reused,
+   so the file never spans much more than capacity. It is anonymous
+   (O_TMPFILE) in dir, so nothing is left behind by a crash. If the disk fills
+   up, the log discards everything and carries on from the next append
+
+   Mapped segments are file pages the kernel can write back and reclaim, so
+   none of this counts as memory held, and shedding just unmaps the read
+   segment */
+class SegmentLog : public ColdStore {
+public:
+  SegmentLog(size_t capacity, const std::string &dir,
+    size_t segmentSize=SEGMENT_SIZE);
+  SegmentLog(SegmentLog &&other);
+  ~SegmentLog();
+
+  SegmentLog(const SegmentLog &other) = delete;
+  SegmentLog &operator=(const SegmentLog &other) = delete;
+
+  void append(const char *from, size_t len) override;
+
+  uint64_t head() const override;
+  uint64_t tail() const override;
+  size_t span(uint64_t from, const char **ptr) const override;
+  size_t storedBytes() const override;
+  size_t memoryBytes() const override;
+  size_t shed(size_t bytes) override;
+
+private:
+  /* start is the absolute offset of its first byte, pos where it is in the
+     file */
+  struct Segment {
+    off_t pos;
+    uint64_t start;
+  };
+
+  bool addSegment();
+  void dropSegment();
+  void clear();
+  char *map(const Segment &segment, int prot) const;
+  void unmap(char *&addr) const;
+
+  size_t _capacity;
+  std::string _dir;
+  size_t _segmentSize;
+  std::deque<Segment> _segments;
+
+  /* The file, opened with the first segment, and the slots in it which
+     deleted segments left free */
+  int _fd;
+  off_t _fileSize;
+  std::vector<off_t> _freeSlots;
+
+  uint64_t _head;
+  uint64_t _tail;
+
+  /* The last segment, mapped for appending, and the most recently read full
+     one */
+  char *_writeMap;
+  mutable uint64_t _readStart;
+  mutable char *_readMap;
+};
+
+#endif
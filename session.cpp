@@ -0,0 +1,1384 @@
+#include "session.h"
+#include "menu.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+
+/* Window switch directions */
+enum class SwitchDir {
+  NEXT,
+  PREV
+};
+
+/* Global window state
+
+   Windows are created at the attached terminal's size, running windowSpec
+   unless told otherwise, in its cwd if set (the daemon moves itself to / but
+   its windows shouldn't). Each keeps scrollbackCapacity bytes of output, all
+   but the most recent of which are compressed in memory, or spilled to
+   spillDir if set
+
+   Scrollback memory is only taken up as output arrives, and all windows
+   together keep to scrollbackBudget (0 for no limit): past it, the windows
+   idle the longest shed their hot pages and then their oldest history first,
+   the current window last. Windows idle for IDLE_RELEASE_NS give back their
+   hot pages anyway, since the cold store has a copy */
+int nextWindowID = 0;
+int currentWindow = 0;
+const size_t DEFAULT_SCROLLBACK_CAPACITY = 16 * 1024 * 1024;
+size_t scrollbackCapacity = DEFAULT_SCROLLBACK_CAPACITY;
+const size_t DEFAULT_SCROLLBACK_BUDGET = 256 * 1024 * 1024;
+const uint64_t IDLE_RELEASE_NS = 60ULL * 1000000000;
+size_t scrollbackBudget = DEFAULT_SCROLLBACK_BUDGET;
+std::string spillDir;
+std::vector<std::unique_ptr<Window>> windows;
+SpawnSpec windowSpec;
+
+/* Windows kept ready for createWindow(), their shells already started and
+   usually idle at a prompt, so a new window appears at once rather than
+   after the shell's startup. Only windows running windowSpec are pooled. The
+   pool is topped up to poolSize at the session terminal's size once a batch
+   of events has been handled and its frame sent, so spawning never delays a
+   key. Pooled windows are drained like any other, and ones which have exited
+   or no longer fit the terminal are discarded
+
+   A window which can't be started (e.g. a mistyped command, or out of
+   descriptors or processes) isn't fatal: the bell rings, and the pool is left
+   short until a window is next started successfully, rather than retried
+   after every batch */
+const int DEFAULT_POOL_SIZE = 1;
+int poolSize = DEFAULT_POOL_SIZE;
+std::vector<std::unique_ptr<Window>> pool;
+bool spawnFailed = false;
+
+/* Every window's fdm is watched at once, so background windows keep draining
+   into their scrollback instead of blocking their children on a full PTY.
+   Anything else the session waits on (stdin, sockets, timers) registers a
+   handler the same way */
+const int MAX_EVENTS = 64;
+const size_t PTY_CHUNK = 4096;
+std::unique_ptr<Poller> poller;
+std::unordered_map<int, FdHandler> fdHandlers;
+
+/* A window closes once its fdm reads EOF or its child is reaped, whichever
+   comes first. SIGCHLD is blocked and read from childSignals, a signalfd, in
+   the event loop like anything else, and every child which has exited by then
+   is reaped in one go, since signals arriving together are merged. Whatever a
+   child wrote last is read before its window goes, up to DRAIN_BYTES in case
+   something it left behind still holds the PTY open. The session ends with
+   its last window */
+const size_t DRAIN_BYTES = 1024 * 1024;
+int childSignals = -1;
+
+/* Each terminal only ever shows its own current window's Screen, drawn by
+   its renderer once per batch of events in which it changed. The one input
+   last came from is the session's terminal, whose window is currentWindow,
+   which Menus and search are drawn on and windows are sized for
+
+   Frames are also rendered at most frameRate times a second (0 for no limit).
+   A window producing output faster than that is still drained at full speed
+   into its Screen, and whatever state it has reached goes out when frameTimer
+   fires. Intermediate states are never drawn, so the terminal's speed no
+   longer limits the multiplexer's */
+const int DEFAULT_FRAME_RATE = 60;
+Terminal *terminal = nullptr;
+std::vector<Terminal *> terminals;
+bool frameDirty = false;
+int frameRate = DEFAULT_FRAME_RATE;
+int frameTimer = -1;
+bool frameTimerArmed = false;
+uint64_t lastFrameNs = 0;
+
+/* The open Menu (window selection or search results), drawn over the current
+   frame while it is fed keys, and what to do with the option chosen. Windows
+   keep running underneath but aren't drawn until it closes */
+std::unique_ptr<Menu> menu;
+std::function<void(int)> menuAction;
+
+/* Search across every window's scrollback: a query typed into a prompt on the
+   bottom row, then a Menu of matches, the chosen one being shown amid the
+   lines around it in historyView until the next key. The live window is drawn
+   again after that */
+const int SEARCH_CONTEXT_LINES = 3;
+const size_t SEARCH_SNIPPET_LEAD = 20;
+const uint64_t SEARCH_VIEW_BYTES = 64 * 1024;
+
+struct SearchMatch {
+  int WID;
+  uint64_t pos;
+};
+
+bool searchPrompt = false;
+std::string searchQuery;
+std::string searchStatus;
+std::vector<SearchMatch> searchMatches;
+std::unique_ptr<Screen> historyView;
+
+/* The stats overlay is a Menu of every window's WindowStats, two lines each,
+   rebuilt whenever statsTimer fires while it is open */
+const time_t STATS_REFRESH_S = 1;
+int statsTimer = -1;
+bool statsShown = false;
+
+/* Forward declarations */
+bool handleFdmRead(Window &window);
+void windowInput(Window &window, const char *buf, size_t len);
+bool closeWindow(Window &window);
+void flushInput(Window &window);
+
+Terminal::Terminal(int rows, int cols):
+  rows(rows),
+  cols(cols),
+  WID(-1),
+  pendingPrefix(false)
+{}
+
+Terminal::~Terminal()
+{}
+
+bool Terminal::mirrorsWindow() const
+{
+  return false;
+}
+
+bool Terminal::congested() const
+{
+  return false;
+}
+
+/* Only a terminal which can reattach later has anything to detach from */
+void Terminal::detach()
+{}
+
+/* Only a terminal which reads a window's fdm itself needs to know */
+void Terminal::windowClosed(const Window &)
+{}
+
+/* Start calling handler whenever fd is ready for events, by default readable */
+void watchFd(int fd, FdHandler handler, uint32_t events)
+{
+  poller->add(fd, events);
+  fdHandlers[fd] = handler;
+}
+
+/* Stop calling fd's handler, e.g. once it reads EOF, since a level-triggered
+   descriptor at EOF would otherwise be reported forever */
+void unwatchFd(int fd)
+{
+  poller->remove(fd);
+  fdHandlers.erase(fd);
+}
+
+std::vector<std::string> getWindowLabels()
+{
+  std::vector<std::string> res;
+
+  for (auto &ptr : windows) {
+    const Scrollback &buffer = ptr->buffer;
+    std::string label = std::to_string(ptr->WID) + " " + ptr->spec.name() +
+      " (" + formatSize(buffer.size()) + " history in " +
+      formatSize(buffer.storedBytes()) + ", " +
+      formatSize(buffer.indexBytes()) + " index)";
+    res.push_back(label);
+  }
+
+  return res;
+}
+
+
+Window &getWindow(int i)
+{
+  return *windows.at(i);
+}
+
+Window *findWindow(int WID)
+{
+  for (auto &ptr : windows) {
+    if (ptr->WID == WID) {
+      return ptr.get();
+    }
+  }
+  return nullptr;
+}
+
+/* Every switch goes through here, so the trace shows which window each frame
+   belongs to. currentWindow is the session's terminal's window, which only
+   that terminal switches away from */
+void setCurrentWindow(int i)
+{
+  currentWindow = i;
+  if (terminal) {
+    terminal->WID = getWindow(i).WID;
+  }
+  traceInstant(TRACE_WINDOW_SWITCH, getWindow(i).WID);
+}
+
+/* Once another terminal becomes the session's one, its window is current
+   again, or if it has none yet, it views the current one */
+void followTerminal()
+{
+  if (!terminal || windows.empty()) {
+    return;
+  }
+  for (size_t i=0; i<windows.size(); ++i) {
+    if (windows[i]->WID == terminal->WID) {
+      currentWindow = i;
+      return;
+    }
+  }
+  terminal->WID = getWindow(currentWindow).WID;
+}
+
+/* Make the window with this ID current, unless it has closed */
+void selectWindow(int WID)
+{
+  for (size_t i=0; i<windows.size(); ++i) {
+    if (windows[i]->WID == WID) {
+      setCurrentWindow(i);
+    }
+  }
+}
+
+/* A window running spec, with no ID until it is added to windows, or null
+   if it couldn't be started */
+Window *spawnWindow(const SpawnSpec &spec)
+{
+  int rows = terminal ? terminal->rows : 24;
+  int cols = terminal ? terminal->cols : 80;
+
+  std::unique_ptr<Window> window;
+  try {
+    window.reset(new Window(-1, scrollbackCapacity, spillDir, rows, cols));
+  } catch (const std::exception &) {
+    spawnFailed = true;
+    return nullptr;
+  }
+
+  window->spec = spec;
+  window->PID = spawnOnPTY(window->fdm, spec);
+  spawnFailed = window->PID == -1;
+  if (spawnFailed) {
+    return nullptr;
+  }
+
+  watchWindow(*window);
+  return window.release();
+}
+
+/* Whether a pooled window can still be handed out */
+bool usableWindow(const Window &window)
+{
+  return fdHandlers.count(window.fdm) && (!terminal ||
+    (window.screen.rows() == terminal->rows &&
+     window.screen.cols() == terminal->cols));
+}
+
+/* Drop pooled windows which can't be used, closing their PTYs */
+void prunePool()
+{
+  for (auto it=pool.begin(); it!=pool.end(); ) {
+    if (usableWindow(**it)) {
+      ++it;
+      continue;
+    }
+    if (fdHandlers.count((*it)->fdm)) {
+      unwatchWindow(**it);
+    }
+    it = pool.erase(it);
+  }
+}
+
+void refillPool()
+{
+  prunePool();
+  while (!spawnFailed && (int) pool.size() < poolSize) {
+    Window *window = spawnWindow(windowSpec);
+    if (window) {
+      pool.push_back(std::unique_ptr<Window>(window));
+    }
+  }
+}
+
+/* The first usable pooled window, or a new one (null if it couldn't be
+   started) */
+Window *takeWindow(const SpawnSpec &spec)
+{
+  if (&spec != &windowSpec) {
+    return spawnWindow(spec);
+  }
+
+  prunePool();
+  if (pool.empty()) {
+    return spawnWindow(spec);
+  }
+
+  Window *window = pool.front().release();
+  pool.erase(pool.begin());
+  return window;
+}
+
+Window *addNewWindow(const SpawnSpec &spec)
+{
+  Window *window = takeWindow(spec);
+  if (!window) {
+    return nullptr;
+  }
+  window->WID = nextWindowID++;
+  /* Since Window wraps a potentially large RingBuffer, we move construct it
+     into the vector, which attempts to move all members recursively by default
+     or uses any user-supplied move constructor
+
+     Note that std::vector will try to use the move constructor when resizing
+     itself */
+  windows.push_back(std::unique_ptr<Window>(window));
+
+  setCurrentWindow(windows.size() - 1);
+  return window;
+}
+
+/* Add a window running spec, and make it current. Returns null with errno
+   set, ringing the bell, if it couldn't be started */
+Window *createWindow(const SpawnSpec &spec)
+{
+  Window *window = addNewWindow(spec);
+  if (!window && terminal) {
+    int err = errno;
+    terminal->send("\a");
+    errno = err;
+  }
+  frameDirty = true;
+  return window;
+}
+
+/* Whether any terminal views the window */
+bool shownWindow(const Window &window)
+{
+  for (Terminal *term : terminals) {
+    if (term->WID == window.WID) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Return whether the session should continue or not. Pending input is
+   written before output is read, since reading EOF closes the window */
+bool handleFdmEvents(Window &window, uint32_t events)
+{
+  if (events & EPOLLOUT) {
+    flushInput(window);
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    return handleFdmRead(window);
+  }
+  return true;
+}
+
+/* Start delivering a window's output, and its fdm being writable while input
+   is pending, to the event loop */
+void watchWindow(Window &window)
+{
+  uint32_t events = window.pendingInput.size() ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  watchFd(window.fdm, [&window](uint32_t events) {
+    return handleFdmEvents(window, events);
+  }, events);
+}
+
+/* Only wait for a watched window's fdm to be writable while it has input
+   pending, since it nearly always is */
+void updateWindowEvents(Window &window)
+{
+  if (fdHandlers.count(window.fdm)) {
+    poller->modify(window.fdm,
+      window.pendingInput.size() ? EPOLLIN | EPOLLOUT : EPOLLIN);
+  }
+}
+
+void unwatchWindow(Window &window)
+{
+  unwatchFd(window.fdm);
+}
+
+/* Update the window's screen with output already in its scrollback, and
+   answer any queries in it. A window a client holds has its output copied
+   here after the client's terminal has answered them */
+void feedScreen(Window &window, const char *buf, size_t len)
+{
+  window.lastActive = monotonicNs();
+  window.stats.output(len, window.lastActive);
+  window.screen.feed(buf, len);
+
+  std::string replies = window.screen.takeReplies();
+  if (!replies.empty() && fdHandlers.count(window.fdm)) {
+    windowInput(window, replies.data(), replies.size());
+  }
+  if (shownWindow(window)) {
+    frameDirty = true;
+  }
+}
+
+/* Remember the last N bytes output from the window, and what they leave on its
+   screen */
+void windowOutput(Window &window, const char *buf, size_t len)
+{
+  window.buffer.write(buf, len);
+  feedScreen(window, buf, len);
+}
+
+/* Keep to scrollbackBudget, see above. Freed heap pages are handed back to the
+   OS (malloc_trim() madvise()s them away), otherwise they would only be
+   reused for the next windows' output */
+void trimScrollback()
+{
+  uint64_t now = monotonicNs();
+  Window *current = windows.empty() ? nullptr : &getWindow(currentWindow);
+  std::vector<Window *> idle;
+  size_t total = 0;
+
+  if (current) {
+    current->lastActive = now;
+  }
+
+  for (auto &ptr : windows) {
+    Window *window = ptr.get();
+    if (window != current && now - window->lastActive >= IDLE_RELEASE_NS) {
+      window->buffer.shed(0);
+    }
+    total += window->buffer.memoryBytes();
+    if (window != current) {
+      idle.push_back(window);
+    }
+  }
+
+  if (!scrollbackBudget || total <= scrollbackBudget) {
+    return;
+  }
+
+  std::sort(idle.begin(), idle.end(), [](Window *a, Window *b) {
+    return a->lastActive < b->lastActive;
+  });
+  if (current) {
+    idle.push_back(current);
+  }
+
+  for (Window *window : idle) {
+    size_t freed = window->buffer.shed(total - scrollbackBudget);
+    total -= std::min(freed, total);
+    if (total <= scrollbackBudget) {
+      break;
+    }
+  }
+  malloc_trim(0);
+}
+
+/* Send each terminal whatever changed on its window's screen (or the history
+   being viewed) since its last frame, in one go. The Menu and search prompt
+   only cover the session's terminal */
+void renderFrame()
+{
+  frameDirty = false;
+  lastFrameNs = monotonicNs();
+
+  for (Terminal *term : terminals) {
+    bool overlay = term == terminal;
+    Window *window = findWindow(term->WID);
+    if (!window || term->mirrorsWindow() || term->congested() ||
+        (overlay && (menu || searchPrompt))) {
+      continue;
+    }
+
+    const Screen &screen = overlay && historyView ? *historyView :
+      window->screen;
+    TraceSpan span(TRACE_RENDER, window->WID);
+    std::string frame = term->renderer.render(screen);
+    span.len = frame.size();
+    if (!frame.empty()) {
+      term->send(frame);
+      window->stats.shown(frame.size(), lastFrameNs);
+    }
+  }
+}
+
+/* E.g. for a terminal which has caught up after being congested */
+void requestFrame()
+{
+  frameDirty = true;
+}
+
+/* Render now if a frame interval has passed since the last one, otherwise arm
+   frameTimer for the rest of the interval */
+void scheduleFrame()
+{
+  if (!frameDirty || frameTimerArmed) {
+    return;
+  }
+
+  uint64_t interval = frameRate ? 1000000000 / frameRate : 0;
+  uint64_t elapsed = monotonicNs() - lastFrameNs;
+  if (elapsed >= interval) {
+    renderFrame();
+    return;
+  }
+
+  /* With 1 frame a second the delay can be a whole second, which tv_nsec
+     can't hold */
+  uint64_t delay = interval - elapsed;
+  struct itimerspec its = {};
+  its.it_value.tv_sec = delay / 1000000000;
+  its.it_value.tv_nsec = delay % 1000000000;
+  if (timerfd_settime(frameTimer, 0, &its, NULL) == -1) {
+    sysError("timerfd_settime");
+  }
+  frameTimerArmed = true;
+}
+
+bool handleFrameTimer(uint32_t)
+{
+  uint64_t expirations;
+  if (read(frameTimer, &expirations, sizeof(expirations)) == -1 &&
+      errno != EAGAIN) {
+    sysError("read");
+  }
+  frameTimerArmed = false;
+  return true;
+}
+
+/* Display on term as well from now on, starting with a full repaint, and
+   make it the session's terminal */
+void attachTerminal(Terminal *term)
+{
+  if (std::find(terminals.begin(), terminals.end(), term) == terminals.end()) {
+    terminals.push_back(term);
+  }
+  term->renderer.invalidate();
+  focusTerminal(term);
+  frameDirty = true;
+}
+
+/* Leave the stats overlay's refresh timer disarmed */
+void closeStats()
+{
+  struct itimerspec its = {};
+  if (statsShown && timerfd_settime(statsTimer, 0, &its, NULL) == -1) {
+    sysError("timerfd_settime");
+  }
+  statsShown = false;
+}
+
+/* Whether the session's terminal shows something other than the live current
+   window */
+bool overlayActive()
+{
+  return menu || searchPrompt || historyView;
+}
+
+/* A Menu or search is abandoned when its terminal stops being the session's
+   one, since nobody is left to answer it, and that terminal is repainted */
+void abandonOverlay()
+{
+  if (terminal && overlayActive()) {
+    terminal->renderer.invalidate();
+    frameDirty = true;
+  }
+  menu.reset();
+  menuAction = nullptr;
+  closeStats();
+  searchPrompt = false;
+  historyView.reset();
+}
+
+/* Windows keep running while nothing displays them. Otherwise the terminal
+   attached last becomes the session's one */
+void detachTerminal(Terminal *term)
+{
+  terminals.erase(std::remove(terminals.begin(), terminals.end(), term),
+    terminals.end());
+  if (term == terminal) {
+    abandonOverlay();
+    terminal = terminals.empty() ? nullptr : terminals.back();
+    followTerminal();
+  }
+}
+
+/* Make term the session's terminal, e.g. because input came from it */
+void focusTerminal(Terminal *term)
+{
+  if (term != terminal) {
+    abandonOverlay();
+    terminal = term;
+  }
+  followTerminal();
+}
+
+/* Go back to the live window, with a full repaint */
+void closeOverlay()
+{
+  searchPrompt = false;
+  historyView.reset();
+  terminal->renderer.invalidate();
+  frameDirty = true;
+}
+
+void handleSwitchWindow(SwitchDir dir)
+{
+  if (dir == SwitchDir::NEXT) {
+    setCurrentWindow((currentWindow + 1) % windows.size());
+  } else {
+    setCurrentWindow(!currentWindow ? windows.size() - 1 : currentWindow - 1);
+  }
+
+  frameDirty = true;
+}
+
+/* The Menu draws over the current frame, and takes keys until it closes */
+void openMenu(const std::vector<std::string> &options,
+  std::function<void(int)> action, int selection=0)
+{
+  menu.reset(new Menu(options, false, false, selection));
+  menuAction = action;
+  terminal->send(CLEAR + menu->takeOutput());
+}
+
+/* Give the Menu a key. Once it closes, the next frame is a full repaint, and
+   the action may open something else in its place */
+void handleMenuKey(unsigned char c)
+{
+  int choice = menu->feed(c);
+  terminal->send(menu->takeOutput());
+  if (choice == Menu::PENDING) {
+    return;
+  }
+
+  std::function<void(int)> action = menuAction;
+  menu.reset();
+  menuAction = nullptr;
+  closeStats();
+  closeOverlay();
+
+  if (choice != Menu::NOCHOICE) {
+    action(choice);
+  }
+}
+
+void drawSearchPrompt()
+{
+  std::string line = "\x1b[" + std::to_string(terminal->rows) +
+    ";1H\x1b[0m\x1b[2K/" + searchQuery;
+  if (!searchStatus.empty()) {
+    line += "  (" + searchStatus + ")";
+  }
+  terminal->send(line);
+}
+
+/* The prompt goes over whatever the terminal shows, so bring that up to date
+   first unless it is showing the window itself */
+void openSearchPrompt()
+{
+  renderFrame();
+  searchPrompt = true;
+  searchQuery.clear();
+  searchStatus.clear();
+  drawSearchPrompt();
+}
+
+/* The line containing a match, without escape sequences, starting a little
+   before the match if the line is too long to show from its start */
+std::string matchSnippet(const Scrollback &buffer, uint64_t pos, size_t width)
+{
+  size_t line = buffer.lineAt(pos);
+  uint64_t start = line ? buffer.lineStart(line - 1) : buffer.head();
+  if (pos - start + searchQuery.size() > width) {
+    start = pos - std::min(pos - start, (uint64_t) SEARCH_SNIPPET_LEAD);
+  }
+
+  std::string raw(width * 2, '\0');
+  raw.resize(buffer.read(start, &raw[0], raw.size()));
+  raw = raw.substr(0, raw.find('\n'));
+
+  std::string text = plainText(raw.data(), raw.size());
+  size_t len = std::min(text.size(), width);
+  while (len < text.size() && ((unsigned char) text[len] & 0xc0) == 0x80) {
+    --len;
+  }
+  size_t skip = 0;
+  while (skip < len && ((unsigned char) text[skip] & 0xc0) == 0x80) {
+    ++skip;
+  }
+  return text.substr(skip, len - skip);
+}
+
+/* Show the history around a match in place of its window, the match in
+   reverse video, as if the window had just printed it */
+void showMatch(int i)
+{
+  const SearchMatch &match = searchMatches.at(i);
+  Window *window = findWindow(match.WID);
+  if (!window) {
+    return;
+  }
+
+  for (size_t j=0; j<windows.size(); ++j) {
+    if (windows[j].get() == window) {
+      setCurrentWindow(j);
+    }
+  }
+
+  const Scrollback &buffer = window->buffer;
+  size_t line = buffer.lineAt(match.pos);
+  size_t before = terminal->rows;
+  size_t after = std::min((size_t) SEARCH_CONTEXT_LINES,
+    (size_t) terminal->rows / 2);
+
+  uint64_t from = line > before ? buffer.lineStart(line - before - 1) :
+    buffer.head();
+  uint64_t to = line + after < buffer.lines() ?
+    buffer.lineStart(line + after) - 1 : buffer.tail();
+  uint64_t matchEnd = std::min(match.pos + searchQuery.size(), to);
+
+  /* Long lines are cut short rather than read in full */
+  if (match.pos - from > SEARCH_VIEW_BYTES) {
+    from = match.pos - SEARCH_VIEW_BYTES;
+  }
+  to = std::min(to, matchEnd + SEARCH_VIEW_BYTES);
+
+  std::string raw(to - from, '\0');
+  raw.resize(buffer.read(from, &raw[0], raw.size()));
+  size_t pos = std::min(match.pos - from, (uint64_t) raw.size());
+  size_t end = std::min(matchEnd - from, (uint64_t) raw.size());
+
+  std::string text = "\x1b[H\x1b[2J" + plainText(raw.data(), pos) +
+    "\x1b[7m" + plainText(raw.data() + pos, end - pos) + "\x1b[27m" +
+    plainText(raw.data() + end, raw.size() - end);
+
+  historyView.reset(new Screen(terminal->rows, terminal->cols));
+  historyView->feed(text.data(), text.size());
+  frameDirty = true;
+}
+
+/* Search the current window first, then the rest in order, listing up to a
+   screenful of matches */
+void runSearch()
+{
+  size_t max = std::max(terminal->rows - 2, 1);
+  std::vector<Window *> order;
+  order.push_back(&getWindow(currentWindow));
+  for (auto &ptr : windows) {
+    if (ptr.get() != order.front()) {
+      order.push_back(ptr.get());
+    }
+  }
+
+  searchMatches.clear();
+  for (Window *window : order) {
+    if (searchMatches.size() >= max) {
+      break;
+    }
+    for (uint64_t pos : window->buffer.find(searchQuery,
+           max - searchMatches.size())) {
+      searchMatches.push_back({window->WID, pos});
+    }
+  }
+
+  if (searchMatches.empty()) {
+    searchStatus = "no matches";
+    drawSearchPrompt();
+    return;
+  }
+
+  std::vector<std::string> options;
+  for (const SearchMatch &match : searchMatches) {
+    const Scrollback &buffer = findWindow(match.WID)->buffer;
+    std::string label = std::to_string(match.WID) + ":" +
+      std::to_string(buffer.lineAt(match.pos) + 1) + "  ";
+    size_t width = terminal->cols > (int) label.size() + 1 ?
+      terminal->cols - label.size() - 1 : 1;
+    options.push_back(label + matchSnippet(buffer, match.pos, width));
+  }
+
+  searchPrompt = false;
+  openMenu(options, showMatch);
+}
+
+/* Printable keys edit the query, Enter searches and Escape gives up */
+void handleSearchKey(unsigned char c)
+{
+  if (c == KEY_ENTER && !searchQuery.empty()) {
+    runSearch();
+    return;
+  } else if (c == KEY_ESC || c == KEY_CTRL_C) {
+    closeOverlay();
+    return;
+  } else if ((c == KEY_BACKSPACE || c == KEY_DEL) && !searchQuery.empty()) {
+    searchQuery.pop_back();
+  } else if (c >= KEY_SPACE && c < KEY_DEL) {
+    searchQuery += c;
+  }
+
+  searchStatus.clear();
+  drawSearchPrompt();
+}
+
+/* Two lines per window, the current one starred */
+std::vector<std::string> getStatsLabels()
+{
+  std::vector<std::string> res;
+  uint64_t now = monotonicNs();
+
+  for (size_t i=0; i<windows.size(); ++i) {
+    const Window &window = *windows[i];
+    const WindowStats &stats = window.stats;
+    const Scrollback &buffer = window.buffer;
+
+    res.push_back(std::string((int) i == currentWindow ? "*" : " ") +
+      std::to_string(window.WID) + " out " + formatSize(stats.bytesRead) +
+      " in " + std::to_string(stats.reads) + " reads (peak " +
+      formatSize(stats.readRate.peak(now)) + "/s), shown " +
+      formatSize(stats.bytesShown) + " in " + std::to_string(stats.frames) +
+      " (peak " + formatSize(stats.shownRate.peak(now)) + "/s)");
+    res.push_back("    in " + formatSize(stats.bytesWritten) + " in " +
+      std::to_string(stats.writes) + " writes, " +
+      std::to_string(stats.shortWrites) + " short, " +
+      std::to_string(stats.stalls) + " stalls, " +
+      formatSize(window.pendingInput.size()) + " pending, dropped " +
+      formatSize(stats.inputDropped) + " of input and " +
+      formatSize(buffer.bytesIn() - buffer.size()) + " of scrollback");
+  }
+
+  return res;
+}
+
+/* Each window has two lines, and is chosen by ID in case it has closed since
+   the Menu was last refreshed */
+void showStats(int selection)
+{
+  std::vector<int> WIDs;
+  for (auto &ptr : windows) {
+    WIDs.push_back(ptr->WID);
+  }
+
+  openMenu(getStatsLabels(), [WIDs](int choice) {
+    selectWindow(WIDs.at(choice / 2));
+  }, selection);
+}
+
+void handleStats()
+{
+  struct itimerspec its = {};
+  its.it_value.tv_sec = STATS_REFRESH_S;
+  its.it_interval.tv_sec = STATS_REFRESH_S;
+  if (timerfd_settime(statsTimer, 0, &its, NULL) == -1) {
+    sysError("timerfd_settime");
+  }
+
+  showStats(0);
+  statsShown = true;
+}
+
+bool handleStatsTimer(uint32_t)
+{
+  uint64_t expirations;
+  if (read(statsTimer, &expirations, sizeof(expirations)) == -1 &&
+      errno != EAGAIN) {
+    sysError("read");
+  }
+  if (statsShown && menu) {
+    showStats(menu->selection());
+  }
+  return true;
+}
+
+/* The same counters for scraping, as one JSON object */
+std::string statsJson()
+{
+  std::string res = "{\"windows\": [";
+  uint64_t now = monotonicNs();
+
+  for (size_t i=0; i<windows.size(); ++i) {
+    const Window &window = *windows[i];
+    const WindowStats &stats = window.stats;
+    const Scrollback &buffer = window.buffer;
+
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s{\"wid\": %d, \"pid\": %d, "
+      "\"current\": %s, \"bytes_read\": %llu, \"reads\": %llu, "
+      "\"peak_read_rate\": %llu, \"bytes_shown\": %llu, \"frames\": %llu, "
+      "\"peak_shown_rate\": %llu, \"bytes_written\": %llu, "
+      "\"writes\": %llu, \"short_writes\": %llu, \"stalls\": %llu, "
+      "\"input_pending\": %llu, \"input_dropped\": %llu, "
+      "\"scrollback_bytes\": %llu, \"scrollback_dropped\": %llu, "
+      "\"stored_bytes\": %llu, \"memory_bytes\": %llu}",
+      i ? ", " : "", window.WID, (int) window.PID,
+      (int) i == currentWindow ? "true" : "false",
+      (unsigned long long) stats.bytesRead, (unsigned long long) stats.reads,
+      (unsigned long long) stats.readRate.peak(now),
+      (unsigned long long) stats.bytesShown, (unsigned long long) stats.frames,
+      (unsigned long long) stats.shownRate.peak(now),
+      (unsigned long long) stats.bytesWritten,
+      (unsigned long long) stats.writes,
+      (unsigned long long) stats.shortWrites,
+      (unsigned long long) stats.stalls,
+      (unsigned long long) window.pendingInput.size(),
+      (unsigned long long) stats.inputDropped,
+      (unsigned long long) buffer.size(),
+      (unsigned long long) (buffer.bytesIn() - buffer.size()),
+      (unsigned long long) buffer.storedBytes(),
+      (unsigned long long) buffer.memoryBytes());
+    res += buf;
+  }
+
+  return res + "]}";
+}
+
+/* Windows by label, with searching as the last option. Windows are chosen by
+   ID, since one may close while the Menu is open */
+void handleSelectWindow()
+{
+  std::vector<std::string> options = getWindowLabels();
+  std::vector<int> WIDs;
+  for (auto &ptr : windows) {
+    WIDs.push_back(ptr->WID);
+  }
+  options.push_back("Search scrollback");
+
+  openMenu(options, [WIDs](int choice) {
+    if (choice < (int) WIDs.size()) {
+      selectWindow(WIDs[choice]);
+    } else {
+      openSearchPrompt();
+    }
+  });
+}
+
+/* Tracing is started and stopped from the keyboard, keeping what was
+   recorded, and dumped separately, so the moment something looked slow can
+   be captured. A failed dump rings the bell */
+void handleTraceToggle()
+{
+  if (tracing) {
+    stopTracing();
+  } else {
+    startTracing();
+  }
+}
+
+void handleTraceDump()
+{
+  if (!traceDump(traceFile())) {
+    terminal->send("\a");
+  }
+}
+
+/* Return whether the session should continue or not (error or EOF) */
+bool handleScreenCommand(unsigned char c)
+{
+  switch (c) {
+  case KEY_DQUOTE: {
+    handleSelectWindow();
+    break;
+  }
+  case KEY_LOWER_C: {
+    createWindow();
+    break;
+  }
+  case KEY_LOWER_D: {
+    terminal->detach();
+    break;
+  }
+  case KEY_SLASH: {
+    openSearchPrompt();
+    break;
+  }
+  case KEY_LOWER_S: {
+    handleStats();
+    break;
+  }
+  case KEY_LOWER_T: {
+    handleTraceToggle();
+    break;
+  }
+  case KEY_UPPER_T: {
+    handleTraceDump();
+    break;
+  }
+  case KEY_LOWER_N: {
+    handleSwitchWindow(SwitchDir::NEXT);
+    break;
+  }
+  case KEY_UPPER_N: {
+    handleSwitchWindow(SwitchDir::PREV);
+    break;
+  }}
+
+  return true;
+}
+
+/* Write to the window's fdm until everything is written or it would block,
+   counting any writes which fall short. Returns how many bytes were written.
+   A window whose child has gone (EIO) takes nothing, and is dropped once its
+   fdm reads EOF */
+size_t writeInput(Window &window, struct iovec *iov, int iovcnt)
+{
+  WindowStats &stats = window.stats;
+  size_t total = 0;
+
+  while (iovcnt > 0) {
+    TraceSpan span(TRACE_PTY_WRITE, window.WID);
+    ssize_t res = writev(window.fdm, iov, iovcnt);
+    span.len = res;
+    ++stats.writes;
+    if (res == -1 && errno == EAGAIN) {
+      ++stats.stalls;
+      break;
+    } else if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 && errno == EIO) {
+      break;
+    } else if (res == -1) {
+      sysError("writev");
+    }
+
+    stats.bytesWritten += res;
+    total += res;
+    skipIov(iov, iovcnt, res);
+    if (iovcnt > 0) {
+      ++stats.shortWrites;
+    }
+  }
+
+  return total;
+}
+
+/* Write input to a window, normally in one write. Whatever its child isn't
+   ready for is queued behind any input already pending, up to
+   INPUT_QUEUE_BYTES, and the rest dropped, so a paste into a busy program
+   never holds up the other windows */
+void windowInput(Window &window, const char *buf, size_t len)
+{
+  RingBuffer &pending = window.pendingInput;
+  size_t written = 0;
+
+  if (!pending.size()) {
+    struct iovec iov = {(void *) buf, len};
+    written = writeInput(window, &iov, 1);
+  }
+  if (written == len) {
+    return;
+  }
+
+  size_t queued = std::min(len - written, pending.capacity() - pending.size());
+  pending.write(buf + written, queued);
+  window.stats.inputDropped += len - written - queued;
+  updateWindowEvents(window);
+}
+
+/* Forward a run of plain input bytes to the current window */
+void forwardInput(const char *buf, size_t len)
+{
+  windowInput(getWindow(currentWindow), buf, len);
+}
+
+/* The window's fdm is writable (EPOLLOUT), so its child has read some input */
+void flushInput(Window &window)
+{
+  RingBuffer &pending = window.pendingInput;
+  struct iovec iov[2];
+
+  int iovcnt = pending.segments(iov);
+  pending.discard(writeInput(window, iov, iovcnt));
+  if (!pending.size()) {
+    updateWindowEvents(window);
+  }
+}
+
+/* Return whether the session should continue or not (error or EOF)
+
+   Input is scanned for the prefix with memchr(), which libc vectorizes, so a
+   paste costs one write per chunk rather than a syscall per byte. Everything
+   between prefixes goes to the window that is current at that point, since a
+   command may switch or create one mid-chunk. A chunk ending in the prefix
+   leaves it pending for the next. While the Menu or search is open, it takes
+   every key, a key closing a viewed match being dropped */
+bool processInput(const char *buf, size_t len)
+{
+  const char *pos = buf;
+  const char *end = buf + len;
+
+  if (pos < end && terminal->pendingPrefix) {
+    terminal->pendingPrefix = false;
+    if (!handleScreenCommand(*pos++)) {
+      return false;
+    }
+  }
+
+  while (pos < end) {
+    if (menu) {
+      handleMenuKey(*pos++);
+      continue;
+    } else if (searchPrompt) {
+      handleSearchKey(*pos++);
+      continue;
+    } else if (historyView) {
+      closeOverlay();
+      ++pos;
+      continue;
+    }
+
+    const char *prefix = (const char *) memchr(pos, KEY_CTRL_A, end - pos);
+    if (!prefix) {
+      forwardInput(pos, end - pos);
+      break;
+    }
+
+    forwardInput(pos, prefix - pos);
+    pos = prefix + 1;
+
+    if (pos == end) {
+      terminal->pendingPrefix = true;
+    } else if (!handleScreenCommand(*pos++)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Read a chunk of the window's output, returning as read() does
+
+   Output is always remembered in the window's scrollback and screen, but only
+   reaches the terminal (through the renderer) when the window is in the
+   foreground. The output is read straight into the scrollback's ring, and the
+   screen is fed from there, so it is never copied on the way in */
+ssize_t readWindow(Window &window)
+{
+  size_t len = PTY_CHUNK;
+  char *buf = window.buffer.reserve(len);
+
+  TraceSpan span(TRACE_PTY_READ, window.WID);
+  ssize_t res = read(window.fdm, buf, len);
+  span.len = res;
+  window.buffer.commit(res > 0 ? res : 0);
+  if (res > 0) {
+    feedScreen(window, buf, res);
+  }
+  return res;
+}
+
+/* Return whether the session should continue or not, i.e. whether any
+   windows are left. EOF (EIO once the slave has closed) closes the window,
+   so nothing may use it afterwards */
+bool handleFdmRead(Window &window)
+{
+  ssize_t res = readWindow(window);
+  if (res == -1 && errno == EAGAIN) {
+    ++window.stats.stalls;
+  } else if (res <= 0 && !(res == -1 && errno == EINTR)) {
+    return closeWindow(window);
+  }
+  return true;
+}
+
+/* Read what the window's child wrote before exiting, which may still be
+   buffered in the PTY, unless a client holding the window reads it */
+void drainWindow(Window &window)
+{
+  for (size_t total=0; total<DRAIN_BYTES; ) {
+    ssize_t res = readWindow(window);
+    if (res > 0) {
+      total += res;
+    } else if (!(res == -1 && errno == EINTR)) {
+      break;
+    }
+  }
+}
+
+/* Drop a window whose child has gone, closing its PTY and freeing its
+   scrollback and screen. Returns false once the last window has closed
+
+   On every terminal viewing it, the window after it (or the last) takes its
+   place. The terminals' renderers still hold the closed window's last frame,
+   so the next one only redraws what differs, rather than clearing the
+   screen, except on a terminal which mirrored the window (see
+   Terminal::windowClosed()). Pooled windows are simply discarded */
+bool closeWindow(Window &window)
+{
+  if (fdHandlers.count(window.fdm)) {
+    unwatchWindow(window);
+  }
+
+  for (auto it=pool.begin(); it!=pool.end(); ++it) {
+    if (it->get() == &window) {
+      pool.erase(it);
+      return true;
+    }
+  }
+
+  auto it = std::find_if(windows.begin(), windows.end(),
+    [&window](const std::unique_ptr<Window> &ptr) {
+      return ptr.get() == &window;
+    });
+  if (it == windows.end()) {
+    return true;
+  }
+
+  for (Terminal *term : terminals) {
+    term->windowClosed(window);
+  }
+
+  int i = it - windows.begin();
+  int WID = window.WID;
+  windows.erase(it);
+  malloc_trim(0);
+
+  if (windows.empty()) {
+    return false;
+  }
+
+  int next = std::min(i, (int) windows.size() - 1);
+  for (Terminal *term : terminals) {
+    if (term->WID == WID) {
+      term->WID = getWindow(next).WID;
+    }
+  }
+  if (i < currentWindow) {
+    --currentWindow;
+  } else if (i == currentWindow) {
+    setCurrentWindow(next);
+  }
+
+  frameDirty = true;
+  return true;
+}
+
+/* The window or pooled window running pid, if any */
+Window *findChild(pid_t pid)
+{
+  for (auto &ptr : windows) {
+    if (ptr->PID == pid) {
+      return ptr.get();
+    }
+  }
+  for (auto &ptr : pool) {
+    if (ptr->PID == pid) {
+      return ptr.get();
+    }
+  }
+  return nullptr;
+}
+
+/* Return whether the session should continue or not. Every child which has
+   exited is reaped, not just the one each queued signal was for */
+bool handleChildSignal(uint32_t)
+{
+  struct signalfd_siginfo info;
+  while (read(childSignals, &info, sizeof(info)) > 0);
+
+  std::vector<pid_t> exited;
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    exited.push_back(pid);
+  }
+
+  bool cont = true;
+  for (pid_t pid : exited) {
+    Window *window = findChild(pid);
+    if (!window) {
+      continue;
+    }
+    if (fdHandlers.count(window->fdm)) {
+      drainWindow(*window);
+    }
+    cont = closeWindow(*window) && cont;
+  }
+  return cont;
+}
+
+/* Dispatch events to their handlers until one ends the session, rendering
+   after each batch. Descriptors watched beforehand (e.g. stdin) are kept */
+void runSession()
+{
+  frameTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (frameTimer == -1) {
+    sysError("timerfd_create");
+  }
+
+  if (!poller) {
+    poller.reset(new Poller());
+  }
+  watchFd(frameTimer, handleFrameTimer);
+
+  statsTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (statsTimer == -1) {
+    sysError("timerfd_create");
+  }
+  watchFd(statsTimer, handleStatsTimer);
+
+  /* Windows are spawned with an empty signal mask, so they don't inherit
+     this. Children which exited before it are reaped straight away */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+    sysError("sigprocmask");
+  }
+  childSignals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (childSignals == -1) {
+    sysError("signalfd");
+  }
+  watchFd(childSignals, handleChildSignal);
+
+  struct epoll_event events[MAX_EVENTS];
+  bool cont = handleChildSignal(0);
+
+  while (cont) {
+    int n;
+    {
+      TraceSpan span(TRACE_POLL_WAIT);
+      n = poller->wait(events, MAX_EVENTS);
+      span.len = n;
+    }
+
+    for (int i=0; cont && i<n; ++i) {
+      /* A descriptor may have been unwatched earlier in this batch */
+      auto it = fdHandlers.find(events[i].data.fd);
+      if (it != fdHandlers.end()) {
+        FdHandler handler = it->second;
+        cont = handler(events[i].events);
+      }
+    }
+
+    if (cont) {
+      trimScrollback();
+      scheduleFrame();
+      if (!frameDirty && terminal) {
+        refillPool();
+      }
+    }
+  }
+
+  unwatchFd(frameTimer);
+  close(frameTimer);
+  unwatchFd(statsTimer);
+  close(statsTimer);
+  unwatchFd(childSignals);
+  close(childSignals);
+}
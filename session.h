@@ -0,0 +1,79 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "poller.h"
+#include "renderer.h"
+#include "window.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <stdint.h>
+
+
+/* Where a session is displayed, i.e. the user's terminal in the standalone
+   shell or an attached client of the daemon, of which there may be several
+
+   The session renders the current window's Screen into send() unless
+   mirrorsWindow(), which means the terminal reads the window's fdm itself and
+   is already showing everything it outputs. Each terminal has its own
+   renderer, so each is sent the changes since its own last frame, and its own
+   current window (WID), switching only when its input asks to. While a
+   terminal is congested(), i.e. behind on output, its frames are skipped,
+   and the next one once it catches up covers everything it missed. A
+   terminal is told of each window closing, before it is freed */
+class Terminal {
+public:
+  Terminal(int rows, int cols);
+  virtual ~Terminal();
+
+  virtual void send(const std::string &bytes) = 0;
+  virtual bool mirrorsWindow() const;
+  virtual bool congested() const;
+  virtual void detach();
+  virtual void windowClosed(const Window &window);
+
+  int rows;
+  int cols;
+  int WID;
+  Renderer renderer;
+  bool pendingPrefix;
+};
+
+/* Called with the epoll events for a watched descriptor. Returns whether the
+   session should continue or not */
+typedef std::function<bool(uint32_t)> FdHandler;
+
+extern std::unique_ptr<Poller> poller;
+extern int currentWindow;
+extern std::vector<std::unique_ptr<Window>> windows;
+extern int frameRate;
+extern size_t scrollbackCapacity;
+extern size_t scrollbackBudget;
+extern std::string spillDir;
+extern SpawnSpec windowSpec;
+extern int poolSize;
+
+void watchFd(int fd, FdHandler handler, uint32_t events=EPOLLIN);
+void unwatchFd(int fd);
+
+Window &getWindow(int i);
+Window *findWindow(int WID);
+Window *createWindow(const SpawnSpec &spec=windowSpec);
+void watchWindow(Window &window);
+void unwatchWindow(Window &window);
+void windowOutput(Window &window, const char *buf, size_t len);
+
+void attachTerminal(Terminal *terminal);
+void detachTerminal(Terminal *terminal);
+void focusTerminal(Terminal *terminal);
+bool overlayActive();
+void requestFrame();
+std::string statsJson();
+bool processInput(const char *buf, size_t len);
+
+void runSession();
+
+#endif
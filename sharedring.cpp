@@ -0,0 +1,337 @@
+#include "sharedring.h"
+#include "utils.h"
+
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Map the header and data of the file, then the data again right after, in
+   one reserved stretch of address space so nothing else can land in between.
+   Returns MAP_FAILED with errno set on failure */
+void *mapTwice(int fd, size_t dataOffset, size_t dataLen, int prot)
+{
+  size_t mapLen = dataOffset + 2 * dataLen;
+  void *addr = mmap(NULL, mapLen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+    0);
+  if (addr == MAP_FAILED) {
+    return addr;
+  }
+
+  char *base = (char *) addr;
+  if (mmap(base, dataOffset + dataLen, prot, MAP_SHARED | MAP_FIXED, fd, 0)
+        == MAP_FAILED ||
+      mmap(base + dataOffset + dataLen, dataLen, prot, MAP_SHARED | MAP_FIXED,
+        fd, dataOffset) == MAP_FAILED) {
+    int err = errno;
+    munmap(addr, mapLen);
+    errno = err;
+    return MAP_FAILED;
+  }
+  return addr;
+}
+
+/* The header gets a page to itself, so that the bytes are page aligned */
+SharedRing::SharedRing(size_t capacity):
+  _fd(-1),
+  _capacity(capacity),
+  _size(0),
+  _touched(0)
+{
+  size_t dataOffset = sysconf(_SC_PAGESIZE);
+  size_t dataLen = dataOffset;
+  while (dataLen < capacity) {
+    dataLen *= 2;
+  }
+  _mask = dataLen - 1;
+  _mapLen = dataOffset + 2 * dataLen;
+
+  _fd = memfd_create("screens-scrollback", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (_fd == -1) {
+    sysError("memfd_create");
+  }
+
+  /* Readers map the whole file, so it must never shrink under them */
+  void *addr = MAP_FAILED;
+  if (ftruncate(_fd, dataOffset + dataLen) == -1 ||
+      fcntl(_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1 ||
+      (addr = mapTwice(_fd, dataOffset, dataLen, PROT_READ | PROT_WRITE))
+        == MAP_FAILED) {
+    int err = errno;
+    close(_fd);
+    errno = err;
+    sysError("SharedRing");
+  }
+
+  _header = new (addr) SharedRingHeader();
+  _header->magic = SHARED_RING_MAGIC;
+  _header->dataOffset = dataOffset;
+  _header->capacity = dataLen;
+  _data = (char *) addr + dataOffset;
+}
+
+SharedRing::SharedRing(SharedRing &&other):
+  _fd(other._fd),
+  _mapLen(other._mapLen),
+  _header(other._header),
+  _data(other._data),
+  _capacity(other._capacity),
+  _mask(other._mask),
+  _size(other._size),
+  _touched(other._touched)
+{
+  other._fd = -1;
+  other._header = nullptr;
+}
+
+SharedRing::~SharedRing()
+{
+  if (_header) {
+    munmap(_header, _mapLen);
+  }
+  if (_fd != -1) {
+    close(_fd);
+  }
+}
+
+size_t SharedRing::size() const
+{
+  return _size;
+}
+
+size_t SharedRing::capacity() const
+{
+  return _capacity;
+}
+
+uint64_t SharedRing::tail() const
+{
+  return _header->tail.load(std::memory_order_relaxed);
+}
+
+/* Only the last bytes of a write longer than the mapped data are copied, but
+   tail still advances past all of it */
+void SharedRing::write(const char *from, size_t len)
+{
+  size_t skip = len > _mask + 1 ? len - (_mask + 1) : 0;
+  size_t copyLen = len - skip;
+
+  reserve(copyLen);
+  memcpy(_data + ((tail() + skip) & _mask), from + skip, copyLen);
+  commit(len);
+}
+
+/* Space for up to len bytes (less if len is more than the mapping holds) at
+   the tail, contiguous even where it wraps. Readers retry until the matching
+   commit(), which must follow before anything else writes, even if nothing
+   was written (0) */
+char *SharedRing::reserve(size_t &len)
+{
+  uint64_t seq = _header->seq.load(std::memory_order_relaxed);
+  _header->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  len = std::min(len, _mask + 1);
+  return _data + (tail() & _mask);
+}
+
+/* Publish len bytes written into the space from reserve() */
+void SharedRing::commit(size_t len)
+{
+  uint64_t seq = _header->seq.load(std::memory_order_relaxed);
+  _header->tail.store(tail() + len, std::memory_order_relaxed);
+  _header->seq.store(seq + 1, std::memory_order_release);
+
+  _size = std::min(_size + len, _capacity);
+  _touched = std::min(_touched + len, _mask + 1);
+}
+
+/* After release(), put back the last len bytes before the tail (up to the
+   capacity), e.g. from the copy kept elsewhere, moving head back over them */
+void SharedRing::refill(const char *from, size_t len)
+{
+  if (len > _capacity) {
+    from += len - _capacity;
+    len = _capacity;
+  }
+
+  uint64_t seq = _header->seq.load(std::memory_order_relaxed);
+  _header->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(_data + ((tail() - len) & _mask), from, len);
+  _header->head.store(tail() - len, std::memory_order_relaxed);
+  _header->seq.store(seq + 2, std::memory_order_release);
+
+  _size = len;
+  _touched = std::max(_touched, len);
+}
+
+/* Readers see the ring empty from the same instant its pages are gone.
+   MADV_REMOVE frees them in the memfd itself, rather than just unmapping
+   them here */
+void SharedRing::release()
+{
+  if (!_touched) {
+    return;
+  }
+
+  uint64_t seq = _header->seq.load(std::memory_order_relaxed);
+  _header->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (madvise(_data, _mask + 1, MADV_REMOVE) == -1) {
+    sysError("madvise");
+  }
+  _header->head.store(tail(), std::memory_order_relaxed);
+  _header->seq.store(seq + 2, std::memory_order_release);
+
+  _size = 0;
+  _touched = 0;
+}
+
+size_t SharedRing::residentBytes() const
+{
+  return _touched;
+}
+
+/* The retained bytes from offset bytes past the oldest, as one span, see
+   RingBuffer::segments() */
+int SharedRing::segments(struct iovec iov[2], size_t offset) const
+{
+  if (offset >= _size) {
+    return 0;
+  }
+
+  size_t len = _size - offset;
+  iov[0].iov_base = _data + ((tail() - len) & _mask);
+  iov[0].iov_len = len;
+  return 1;
+}
+
+size_t SharedRing::peek(char *into, size_t len, size_t offset) const
+{
+  struct iovec iov[2];
+  if (!segments(iov, offset)) {
+    return 0;
+  }
+
+  size_t copied = std::min(len, iov[0].iov_len);
+  memcpy(into, iov[0].iov_base, copied);
+  return copied;
+}
+
+/* A new descriptor for the same memory which can only be mapped read-only,
+   for passing to another process. The caller closes it */
+int SharedRing::shareFd() const
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", _fd);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* fd may be closed once the view exists */
+SharedRingView::SharedRingView(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    sysError("fstat");
+  }
+  _mapLen = st.st_size;
+
+  /* Read the header first to learn how to map the data twice */
+  void *addr = mmap(NULL, _mapLen, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    sysError("mmap");
+  }
+
+  const SharedRingHeader *header = (const SharedRingHeader *) addr;
+  bool valid = _mapLen >= sizeof(SharedRingHeader) &&
+    header->magic == SHARED_RING_MAGIC &&
+    header->dataOffset + header->capacity == _mapLen &&
+    !(header->capacity & (header->capacity - 1));
+  size_t dataOffset = valid ? header->dataOffset : 0;
+  size_t dataLen = valid ? header->capacity : 0;
+  munmap(addr, _mapLen);
+
+  if (!valid) {
+    throw std::runtime_error("SharedRingView: not a SharedRing");
+  }
+
+  addr = mapTwice(fd, dataOffset, dataLen, PROT_READ);
+  if (addr == MAP_FAILED) {
+    sysError("mmap");
+  }
+  _mapLen = dataOffset + 2 * dataLen;
+  _header = (const SharedRingHeader *) addr;
+  _data = (const char *) addr + dataOffset;
+}
+
+SharedRingView::SharedRingView(SharedRingView &&other):
+  _mapLen(other._mapLen),
+  _header(other._header),
+  _data(other._data)
+{
+  other._header = nullptr;
+}
+
+SharedRingView::~SharedRingView()
+{
+  if (_header) {
+    munmap((void *) _header, _mapLen);
+  }
+}
+
+uint64_t SharedRingView::tail() const
+{
+  return _header->tail.load(std::memory_order_acquire);
+}
+
+/* Copy the retained bytes from absolute offset from up to the tail, as they
+   were at one instant. from is moved to the offset of the first byte copied,
+   which is later if those bytes have been overwritten
+
+   A write landing during the copy makes the seq differ and the copy is taken
+   again. The owner's writes are one PTY read each, so this settles quickly,
+   unless the owner never finishes one: after SNAPSHOT_TIMEOUT_NS, returns
+   false with errno set to ETIMEDOUT */
+bool SharedRingView::snapshot(std::string &into, uint64_t &from) const
+{
+  uint64_t capacity = _header->capacity;
+  uint64_t deadline = monotonicNs() + SNAPSHOT_TIMEOUT_NS;
+
+  while (true) {
+    uint64_t seq = _header->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      if (monotonicNs() >= deadline) {
+        errno = ETIMEDOUT;
+        return false;
+      }
+      sched_yield();
+      continue;
+    }
+
+    uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+    uint64_t head = std::max(_header->head.load(std::memory_order_relaxed),
+      tail > capacity ? tail - capacity : 0);
+    uint64_t start = std::min(std::max(from, head), tail);
+
+    into.assign(_data + (start & (capacity - 1)), tail - start);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_header->seq.load(std::memory_order_relaxed) == seq) {
+      from = start;
+      return true;
+    }
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef SHAREDRING_H
+#define SHAREDRING_H
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+const uint32_t SHARED_RING_MAGIC = 0x53524e47;
+
+/* How long a reader waits for a write to finish before giving up, e.g. on an
+   owner which died or stopped in the middle of one */
+const uint64_t SNAPSHOT_TIMEOUT_NS = 1000000000;
+
+/* The first page of a SharedRing's memory, followed by its bytes
+
+   Only the owner writes. tail is the absolute offset of the next byte to be
+   written, so the byte at offset p (tail - capacity <= p < tail) is at
+   p % capacity in the data, capacity being a power of two. seq is odd while
+   a write is copying bytes in and is bumped again once tail covers them, so
+   a reader which sees the same even seq before and after copying knows its
+   copy is consistent. head is moved up to tail when the owner gives the
+   memory back, and nothing before it is valid */
+struct SharedRingHeader {
+  uint32_t magic;
+  uint32_t dataOffset;
+  uint64_t capacity;
+  std::atomic<uint64_t> seq;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> head;
+};
+
+/* A circular buffer which overwrites its oldest bytes, kept in a memfd so that
+   other processes can map it read-only, see SharedRingView
+
+   An attaching client can then see a window's whole history without it being
+   copied over a socket, and the daemon keeps appending meanwhile. Offsets
+   given to segments() and peek() count from the oldest retained byte, as with
+   RingBuffer
+
+   The data pages are mapped twice in a row, so a run of bytes which wraps
+   around the end of the buffer is still contiguous in memory. Writes and
+   reads are a single memcpy(), segments() is always one span, and reserve()
+   hands out the space at the tail for e.g. read() to fill in place, which
+   commit() then publishes. The mapped size is capacity rounded up to a power
+   of two pages
+
+   Pages are only allocated as they are first written, and release() returns
+   them all to the OS, emptying the ring, e.g. once its bytes are also kept
+   elsewhere, from where refill() can put them back. residentBytes() is how
+   much has been written since */
+class SharedRing {
+public:
+  SharedRing(size_t capacity);
+  SharedRing(SharedRing &&other);
+  ~SharedRing();
+
+  SharedRing(const SharedRing &other) = delete;
+  SharedRing &operator=(const SharedRing &other) = delete;
+
+  size_t size() const;
+  size_t capacity() const;
+  uint64_t tail() const;
+  void write(const char *from, size_t len);
+  char *reserve(size_t &len);
+  void commit(size_t len);
+  void release();
+  void refill(const char *from, size_t len);
+  size_t residentBytes() const;
+
+  int segments(struct iovec iov[2], size_t offset=0) const;
+  size_t peek(char *into, size_t len, size_t offset=0) const;
+
+  int shareFd() const;
+
+private:
+  int _fd;
+  size_t _mapLen;
+  SharedRingHeader *_header;
+  char *_data;
+  size_t _capacity;
+  size_t _mask;
+  size_t _size;
+  size_t _touched;
+};
+
+/* Another process's SharedRing, mapped read-only from a descriptor it
+   shared */
+class SharedRingView {
+public:
+  SharedRingView(int fd);
+  SharedRingView(SharedRingView &&other);
+  ~SharedRingView();
+
+  SharedRingView(const SharedRingView &other) = delete;
+  SharedRingView &operator=(const SharedRingView &other) = delete;
+
+  uint64_t tail() const;
+  bool snapshot(std::string &into, uint64_t &from) const;
+
+private:
+  size_t _mapLen;
+  const SharedRingHeader *_header;
+  const char *_data;
+};
+
+#endif
@@ -1,305 +1,117 @@
 #include "menu.h"
+#include "outputstage.h"
+#include "session.h"
+#include "trace.h"
 #include "utils.h"
-#include "window.h"
 
 #include <string>
 #include <vector>
-#include <memory>
-#include <utility>
 #include <stdexcept>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
 
 #include <errno.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/select.h>
 
 
-/* Window switch directions */
-enum class SwitchDir {
-  NEXT,
-  PREV
-};
-
-/* Ctrl-A */
-const unsigned char ASCII_1 = 1;
-
-/* Global window state */
-int nextWindowID = 0;
-int currentWindow = 0;
-const int SCROLLBACK_CAPACITY = 1024;
-std::vector<std::unique_ptr<Window>> windows;
-
-/* Forward declarations */
-void runChild(int fdm);
-
-std::vector<std::string> getWindowLabels()
-{
-  std::vector<std::string> res;
-
-  for (auto &ptr : windows) {
-    std::string label = std::to_string(ptr->WID) + " bash";
-    res.push_back(label);
-  }
-
-  return res;
-}
-
-void forkWindow(Window &window)
-{
-  pid_t pid = fork();
-  if (pid == -1) {
-    sysError("fork");
-  } else if (pid > 0) {
-    window.PID = pid;
-  } else {
-    runChild(window.fdm);
-  }
-}
-
-Window &getWindow(int i)
-{
-  return *windows.at(i);
-}
-
-Window &addNewWindow()
-{
-  Window *window = new Window(nextWindowID++, SCROLLBACK_CAPACITY);
-  /* Since Window wraps a potentially large RingBuffer, we move construct it
-     into the vector, which attempts to move all members recursively by default
-     or uses any user-supplied move constructor
-
-     Note that std::vector will try to use the move constructor when resizing
-     itself */
-  windows.push_back(std::unique_ptr<Window>(window));
-
-  currentWindow = windows.size() - 1;
-  return getWindow(currentWindow);
-}
-
-/* Multiplex read on stdin and the pseudo-terminal master, expects a non-null
-   fd_set */
-int fdmStdinRselect(fd_set *rset, int fdm)
-{
-  FD_ZERO(rset);
-  FD_SET(fdm, rset);
-  FD_SET(STDIN_FILENO, rset);
-
-  return select(
-    fdm + 1, /* largest + 1 */
-    rset, /* read */
-    NULL, /* write */
-    NULL, /* error */
-    NULL /* timeout */
-  );
-}
-
-/* Unix write() may only process some of the request bytes, it may also be
-   interrupted by a signal. This helper continues writing untill all requested
-   bytes are processed, or I/O error */
-int writeAll(int fd, char *buf, size_t len)
-{
-  size_t i = 0;
-
-  while (i < len) {
-    int res = write(fd, buf + i, len);
-    if (res == -1) {
-      if (errno == EINTR) {
-        continue;
-      }
-      return -1;
+/* Stdin is read in chunks of up to this size */
+const size_t STDIN_CHUNK = 4096;
+
+/* The user's terminal, when the session runs in the same process rather than
+   behind the daemon
+
+   Output is staged and written as stdout takes it, stdout being watched for
+   EPOLLOUT only while anything is left over, so a slow terminal never holds
+   up input or the windows. Past the stage's high-water mark, frames are
+   skipped while windows keep draining into their screens, and the first one
+   after it catches up shows where they got to */
+class LocalTerminal : public Terminal {
+public:
+  LocalTerminal(int rows, int cols):
+    Terminal(rows, cols),
+    _stage(STDOUT_FILENO),
+    _watching(false)
+  {}
+
+  void send(const std::string &bytes) override
+  {
+    _stage.send(bytes.data(), bytes.size());
+    flush();
+  }
+
+  bool congested() const override
+  {
+    return _stage.full();
+  }
+
+  void flush()
+  {
+    bool wasFull = _stage.full();
+    bool done = _stage.flush();
+
+    if (!done && !_watching) {
+      watchFd(STDOUT_FILENO, [this](uint32_t) {
+        flush();
+        return true;
+      }, EPOLLOUT);
+      _watching = true;
+    } else if (done && _watching) {
+      unwatchFd(STDOUT_FILENO);
+      _watching = false;
     }
-    i += res;
-  }
-
-  return len;
-}
-
-void reOutputWindow()
-{
-  size_t res;
-  char buf[512];
 
-  /* in order to read non-destructively, we make a copy
-     todo: avoid unnecessary buffering */
-  RingBuffer ringBuf = getWindow(currentWindow).buffer;
-
-  /* Dump the buffer which represents the last N bytes of output */
-  while ((res = ringBuf.read(buf, sizeof(buf))) > 0) {
-    if (writeAll(STDOUT_FILENO, buf, res) == -1) {
-      sysError("writeAll");
+    if (wasFull && !_stage.full()) {
+      requestFrame();
     }
   }
-}
-
-void handleSwitchWindow(SwitchDir dir)
-{
-  printf("%s", CLEAR);
-
-  if (dir == SwitchDir::NEXT) {
-    printf("[Next screen]\r\n");
-    currentWindow = (currentWindow + 1) % windows.size();
-  } else {
-    printf("[Previous screen]\r\n");
-    currentWindow = !currentWindow ? windows.size() - 1 : currentWindow - 1;
-  }
-
-  reOutputWindow();
-}
-
-void handleCreateWindow()
-{
-  printf("%s", CLEAR);
-  printf("[Create screen]\r\n");
-  Window &window = addNewWindow();
-  forkWindow(window);
-}
-
-void handleSelectWindow()
-{
-  printf("%s", CLEAR);
-  printf("[List screens]\r\n");
 
-  std::vector<std::string> options = getWindowLabels();
-  Menu menu(options, true, false);
-
-  int choice = menu.run();
-  menu.close();
-
-  if (choice != Menu::NOCHOICE) {
-    currentWindow = choice;
-  }
-  reOutputWindow();
-}
-
-/* Return whether the parent loop should continue or not (error or EOF) */
-bool handleScreenCommand()
-{
-  int res = fgetc(stdin);
-  if (res == EOF) {
-    return false;
-  }
-
-  switch (res) {
-  case KEY_DQUOTE: {
-    handleSelectWindow();
-    break;
-  }
-  case KEY_LOWER_C: {
-    handleCreateWindow();
-    break;
-  }
-  case KEY_LOWER_N: {
-    handleSwitchWindow(SwitchDir::NEXT);
-    break;
-  }
-  case KEY_UPPER_N: {
-    handleSwitchWindow(SwitchDir::PREV);
-    break;
-  }}
-
-  return true;
-}
+private:
+  OutputStage _stage;
+  bool _watching;
+};
 
-/* Return whether the parent loop should continue or not (error or EOF) */
-bool handleStdinRead(Window &window)
+/* Return whether the session should continue or not (error or EOF) */
+bool handleStdinRead(uint32_t)
 {
-  int res = fgetc(stdin);
-  if (res == EOF) {
-    return false;
-  }
-
-  unsigned char c = res;
-  if (c == ASCII_1) {
-    return handleScreenCommand();
-  } else {
-    if (writeAll(window.fdm, (char *) &c, 1) == -1) {
-      sysError("write");
-    }
+  char buf[STDIN_CHUNK];
+  int res;
+  {
+    TraceSpan span(TRACE_STDIN_READ);
+    res = span.len = read(STDIN_FILENO, buf, sizeof(buf));
   }
 
-  return true;
-}
-
-/* Return whether the parent loop should continue or not (error or EOF) */
-bool handleFdmRead(Window &window)
-{
-  char buf[512];
-
-  int res = read(window.fdm, buf, sizeof(buf));
-  if (res > 0) {
-    /* Remember the last N bytes output from the window
-       todo: start from first full line */
-    window.buffer.write(buf, res);
-    /* Write to STDOUT */
-    if (writeAll(STDOUT_FILENO, buf, res) == -1) {
-      sysError("writeall");
-    }
-  } else {
+  if (res == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  } else if (res == -1) {
+    sysError("read");
+  } else if (res == 0) {
     return false;
   }
 
-  return true;
+  return processInput(buf, res);
 }
 
 /* Forwards raw bytes to slave, print slave output */
-void runParent()
+void runParent(LocalTerminal &terminal)
 {
   if (!setTerminalRawio()) {
     sysError("set_rawio");
   }
 
-  fd_set rset;
-  bool cont = true;
-
-  while (cont) {
-    Window &window = getWindow(currentWindow);
-    if (fdmStdinRselect(&rset, window.fdm) == -1) {
-      sysError("fdmStdinRselect");
-    }
-
-    /* Act on current Window */
-    if (FD_ISSET(STDIN_FILENO, &rset)) {
-      cont = handleStdinRead(window);
-    } else if (FD_ISSET(window.fdm, &rset)) {
-      cont = handleFdmRead(window);
-    }
-  }
-}
-
-/* Side effect may be new session id and group id! */
-bool acquireCTTY(int fdm)
-{
-  int res = false;
-
-  char *path = ptsname(fdm);
-  if (path) {
-    if (setsid() != -1) {
-      int fds = open(path, O_RDWR);
-      if (fds != -1) {
-        if (resetStddes(fds)) {
-          res = true;
-          close(fdm);
-        }
-        close(fds);
-      }
-    }
-  }
+  /* Windows are drawn on the alternate screen, leaving the user's shell
+     session intact underneath */
+  terminal.send(TO_ALT_BUF);
 
-  return res;
-}
+  watchFd(STDIN_FILENO, handleStdinRead);
+  runSession();
 
-/* Obtain new controlling tty (slave) from fdm (master) and exec Bash */
-void runChild(int fdm)
-{
-  if (!acquireCTTY(fdm)) {
-    sysError("acquireCTTY");
+  if (tracing) {
+    traceDump(traceFile());
   }
 
-  execl("/bin/bash", "bash", NULL);
-  sysError("execl");
+  terminal.send(std::string(RESET) + FROM_ALT_BUF);
 }
 
 void demoShell()
@@ -308,19 +120,24 @@ void demoShell()
     throw std::runtime_error("Stdin must be connected to a terminal.");
   }
 
-  Window &window = addNewWindow();
-
-  /* Note the parent closing causes the child to receive SIGHUP while the child
-     exiting causes the parent to read EOF from fdm */
-  pid_t pid = fork();
-  if (pid == -1) {
-    sysError("fork");
-  } else if (pid) {
-    window.PID = pid;
-    runParent();
-  } else {
-    runChild(window.fdm);
+  /* Wide characters are measured with wcwidth(), which needs the user's
+     locale rather than the C one */
+  setlocale(LC_CTYPE, "");
+
+  int rows, cols;
+  terminalSize(rows, cols);
+  LocalTerminal terminal(rows, cols);
+
+  poller.reset(new Poller());
+  attachTerminal(&terminal);
+
+  /* Note the parent closing causes the child to receive SIGHUP, while the
+     child exiting closes its window, and the last one the session */
+  if (!createWindow()) {
+    throw std::runtime_error("Could not start " + windowSpec.path + ": " +
+      strError(errno));
   }
+  runParent(terminal);
 }
 
 /* Todo:
@@ -332,17 +149,66 @@ void demoShell()
       - [DONE] Track windows in a global vector
       - [DONE] Create new
       - [DONE] Switch to next/previous window
-      - Detect when a window closes and either update view or terminate when
-        last one closes
+      - [DONE] Detect when a window closes and either update view or terminate
+        when last one closes
 
       Note:
       This includes maintaining a circular buffer for each window representing
       the last N bytes outputtted
 
-   3. Daemonize server and make a client to communicate with it via Unix
-      socket */
-int main()
+   3. [DONE] Daemonize server and make a client to communicate with it via Unix
+      socket (daemon.cpp and client.cpp, this file runs a session in-process) */
+void usage(const char *name)
 {
+  fprintf(stderr, "Usage: %s [-r frames per second, 0 for no limit] "
+    "[-s scrollback bytes per window, e.g. 256M] "
+    "[-d directory to spill scrollback to, rather than compress it] "
+    "[-m scrollback memory for all windows, 0 for no limit] "
+    "[-t trace from the start, dumping to this file on exit] "
+    "[-w windows to keep started ahead of time, default 1] "
+    "[command [args...] for new windows, default /bin/bash]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "+r:s:d:m:t:w:")) != -1) {
+    if (opt == 'r') {
+      if (!parseCount(optarg, frameRate)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 'd') {
+      spillDir = optarg;
+    } else if (opt == 's') {
+      if (!parseSize(optarg, scrollbackCapacity) || !scrollbackCapacity) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 'm') {
+      if (!parseSize(optarg, scrollbackBudget)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 't') {
+      tracePath = optarg;
+      startTracing();
+    } else if (opt == 'w') {
+      if (!parseCount(optarg, poolSize)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    windowSpec = SpawnSpec(std::vector<std::string>(argv + optind,
+      argv + argc));
+  }
+
   try {
     demoShell();
   } catch (const std::exception &ex) {
@@ -0,0 +1,145 @@
+#include "spawner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+extern char **environ;
+
+/* An interactive bash, as windows always used to run */
+SpawnSpec::SpawnSpec():
+  path("/bin/bash"),
+  argv({"bash"})
+{}
+
+SpawnSpec::SpawnSpec(const std::vector<std::string> &argv):
+  path(argv.at(0)),
+  argv(argv)
+{}
+
+/* The program's base name, for labelling its window */
+std::string SpawnSpec::name() const
+{
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/* The session's environment with spec.env's entries replacing any of the same
+   name */
+std::vector<std::string> spawnEnvironment(const SpawnSpec &spec)
+{
+  std::vector<std::string> res;
+
+  for (char **var=environ; *var; ++var) {
+    const char *eq = strchr(*var, '=');
+    size_t nameLen = eq ? eq - *var : strlen(*var);
+    bool replaced = false;
+    for (const std::string &entry : spec.env) {
+      if (!entry.compare(0, nameLen + 1, *var, nameLen + 1)) {
+        replaced = true;
+      }
+    }
+    if (!replaced) {
+      res.push_back(*var);
+    }
+  }
+
+  res.insert(res.end(), spec.env.begin(), spec.env.end());
+  return res;
+}
+
+/* spec.cwd, or if it is no longer a directory (e.g. it was removed after the
+   session started in it), $HOME, or failing that / */
+std::string spawnDir(const SpawnSpec &spec)
+{
+  const char *home = getenv("HOME");
+  for (const char *dir : {spec.cwd.c_str(), home ? home : "", "/"}) {
+    struct stat st;
+    if (*dir && stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+      return dir;
+    }
+  }
+  return "/";
+}
+
+std::vector<char *> pointers(std::vector<std::string> &strings)
+{
+  std::vector<char *> res;
+  for (std::string &str : strings) {
+    res.push_back(&str[0]);
+  }
+  res.push_back(nullptr);
+  return res;
+}
+
+/* Start spec on the slave of fdm's PTY, returning its PID or -1 with errno
+   set
+
+   This used to be fork() followed by acquireCTTY() in the child, but fork()
+   copies the page tables of the whole session, scrollback and all, so it got
+   slower the longer the session ran. posix_spawn() is built on
+   clone(CLONE_VM | CLONE_VFORK) in glibc, which shares the parent's memory
+   until the exec, so it costs the same whatever the session's size
+
+   The child does what acquireCTTY() did, as spawn attributes and file
+   actions, in the order glibc applies them: setsid() to lead a new session,
+   then opening the slave, which as the first terminal the session leader
+   opens becomes its controlling terminal, as stdin, stdout and stderr. The
+   master is close-on-exec. Signal dispositions and the signal mask are
+   reset, since the session may block or handle signals its windows
+   shouldn't inherit */
+pid_t spawnOnPTY(int fdm, const SpawnSpec &spec)
+{
+  char slave[128];
+  if (ptsname_r(fdm, slave, sizeof(slave))) {
+    return -1;
+  }
+
+  std::vector<std::string> argv = spec.argv;
+  std::vector<std::string> env = spawnEnvironment(spec);
+  std::vector<char *> argvPtrs = pointers(argv);
+  std::vector<char *> envPtrs = pointers(env);
+
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_init(&actions);
+
+  sigset_t none, all;
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK |
+    POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+
+  std::string dir = spec.cwd.empty() ? "" : spawnDir(spec);
+  if (!dir.empty()) {
+    posix_spawn_file_actions_addchdir_np(&actions, dir.c_str());
+  }
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, slave, O_RDWR, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+
+  pid_t pid;
+  int res = spec.path.find('/') == std::string::npos ?
+    posix_spawnp(&pid, spec.path.c_str(), &actions, &attr, argvPtrs.data(),
+      envPtrs.data()) :
+    posix_spawn(&pid, spec.path.c_str(), &actions, &attr, argvPtrs.data(),
+      envPtrs.data());
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (res) {
+    errno = res;
+    return -1;
+  }
+  return pid;
+}
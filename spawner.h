@@ -0,0 +1,28 @@
+#ifndef SPAWNER_H
+#define SPAWNER_H
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+
+/* What a window runs: a program (looked up in PATH unless it contains a /),
+   its argv including argv[0], NAME=value entries added to or overriding the
+   session's environment, and the directory to start in (empty for the
+   session's own) */
+struct SpawnSpec {
+  SpawnSpec();
+  SpawnSpec(const std::vector<std::string> &argv);
+
+  std::string name() const;
+
+  std::string path;
+  std::vector<std::string> argv;
+  std::vector<std::string> env;
+  std::string cwd;
+};
+
+pid_t spawnOnPTY(int fdm, const SpawnSpec &spec);
+
+#endif
@@ -0,0 +1,54 @@
+#include "stats.h"
+
+#include <algorithm>
+
+
+RateMeter::RateMeter():
+  intervalStart(0),
+  intervalBytes(0),
+  peakRate(0)
+{}
+
+void RateMeter::add(uint64_t bytes, uint64_t now)
+{
+  peakRate = peak(now);
+  if (now - intervalStart >= RATE_INTERVAL_NS) {
+    intervalStart = now;
+    intervalBytes = 0;
+  }
+  intervalBytes += bytes;
+}
+
+uint64_t RateMeter::peak(uint64_t now) const
+{
+  if (now - intervalStart < RATE_INTERVAL_NS) {
+    return peakRate;
+  }
+  return std::max(peakRate, intervalBytes * 1000000000 / RATE_INTERVAL_NS);
+}
+
+WindowStats::WindowStats():
+  bytesRead(0),
+  reads(0),
+  bytesShown(0),
+  frames(0),
+  bytesWritten(0),
+  writes(0),
+  shortWrites(0),
+  stalls(0),
+  inputDropped(0)
+{}
+
+void WindowStats::output(size_t len, uint64_t now)
+{
+  bytesRead += len;
+  ++reads;
+  readRate.add(len, now);
+}
+
+void WindowStats::shown(size_t len, uint64_t now)
+{
+  bytesShown += len;
+  ++frames;
+  shownRate.add(len, now);
+}
@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Peak rates are measured over intervals of this length */
+const uint64_t RATE_INTERVAL_NS = 1000000000;
+
+/* The highest rate seen for a stream of bytes, in bytes per second over any
+   whole RATE_INTERVAL_NS (the interval in progress counts once it is over) */
+struct RateMeter {
+  RateMeter();
+
+  void add(uint64_t bytes, uint64_t now);
+  uint64_t peak(uint64_t now) const;
+
+  uint64_t intervalStart;
+  uint64_t intervalBytes;
+  uint64_t peakRate;
+};
+
+/* What a window has cost the multiplexer, for finding the one flooding it
+
+   Output is counted as it is read from the fdm, whether here or by a client
+   holding it. Shown is what reached the terminal on the window's behalf:
+   frames rendered while it was current, or the output a client wrote itself.
+   Input only counts what went through the session, not keys a client
+   typed straight into a window it held. A stall is a read or write which
+   found the fdm not ready (EAGAIN). Input dropped is what arrived while the
+   window's pending input was full */
+struct WindowStats {
+  WindowStats();
+
+  void output(size_t len, uint64_t now);
+  void shown(size_t len, uint64_t now);
+
+  uint64_t bytesRead;
+  uint64_t reads;
+  uint64_t bytesShown;
+  uint64_t frames;
+  uint64_t bytesWritten;
+  uint64_t writes;
+  uint64_t shortWrites;
+  uint64_t stalls;
+  uint64_t inputDropped;
+  RateMeter readRate;
+  RateMeter shownRate;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "trace.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+bool tracing = false;
+std::string tracePath;
+
+const char *TRACE_NAMES[] = {
+  "poll_wait",
+  "stdin_read",
+  "pty_read",
+  "pty_write",
+  "terminal_write",
+  "render",
+  "window_switch"
+};
+
+struct TraceRing {
+  TraceRing():
+    events(TRACE_RING_EVENTS),
+    count(0),
+    tid(syscall(SYS_gettid))
+  {}
+
+  std::vector<TraceEvent> events;
+  std::atomic<uint64_t> count;
+  pid_t tid;
+};
+
+/* Every thread's ring, which outlives it so its events can still be dumped.
+   The lock is only taken to add a ring and to dump */
+std::mutex ringsLock;
+std::vector<std::unique_ptr<TraceRing>> rings;
+thread_local TraceRing *localRing = nullptr;
+
+TraceRing *addRing()
+{
+  std::lock_guard<std::mutex> lock(ringsLock);
+  rings.push_back(std::unique_ptr<TraceRing>(new TraceRing()));
+  localRing = rings.back().get();
+  return localRing;
+}
+
+/* The calling thread's ring is allocated now rather than on its first event */
+void startTracing()
+{
+  if (!localRing) {
+    addRing();
+  }
+  tracing = true;
+}
+
+void stopTracing()
+{
+  tracing = false;
+}
+
+/* The default is in the same private directory as the socket, rather than
+   at a name under /tmp anyone could create first. Empty if it is unusable */
+std::string traceFile()
+{
+  if (!tracePath.empty()) {
+    return tracePath;
+  }
+
+  std::string dir = "/tmp/screens-" + std::to_string(getuid());
+  if (!privateDir(dir)) {
+    return "";
+  }
+  return dir + "/trace-" + std::to_string(getpid()) + ".json";
+}
+
+void traceRecord(uint16_t type, uint64_t start, uint64_t end, int WID,
+  int len)
+{
+  TraceRing *ring = localRing ? localRing : addRing();
+  uint64_t n = ring->count.load(std::memory_order_relaxed);
+
+  TraceEvent &event = ring->events[n % TRACE_RING_EVENTS];
+  event.start = start;
+  event.dur = end - start;
+  event.type = type;
+  event.WID = WID;
+  event.len = len;
+
+  ring->count.store(n + 1, std::memory_order_release);
+}
+
+/* Write the recorded events to path, oldest first per thread. Times are in
+   microseconds, as the format requires. Returns false on I/O error */
+bool traceDump(const std::string &path)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+    O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  FILE *file = fdopen(fd, "w");
+  if (!file) {
+    close(fd);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(ringsLock);
+  pid_t pid = getpid();
+  bool first = true;
+
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (auto &ring : rings) {
+    uint64_t count = ring->count.load(std::memory_order_acquire);
+    uint64_t from = count > TRACE_RING_EVENTS ? count - TRACE_RING_EVENTS : 0;
+
+    for (uint64_t i=from; i<count; ++i) {
+      const TraceEvent &event = ring->events[i % TRACE_RING_EVENTS];
+      fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, ",
+        first ? "" : ",\n", TRACE_NAMES[event.type],
+        event.dur ? "X" : "i", event.start / 1e3);
+      if (event.dur) {
+        fprintf(file, "\"dur\": %.3f, ", event.dur / 1e3);
+      } else {
+        fprintf(file, "\"s\": \"t\", ");
+      }
+      fprintf(file, "\"pid\": %d, \"tid\": %d, \"args\": {\"wid\": %d, "
+        "\"len\": %d}}", (int) pid, (int) ring->tid, event.WID, event.len);
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  return fclose(file) == 0;
+}
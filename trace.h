@@ -0,0 +1,96 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Events recorded per thread before the oldest are overwritten */
+const size_t TRACE_RING_EVENTS = 64 * 1024;
+
+enum TraceType : uint16_t {
+  TRACE_POLL_WAIT,
+  TRACE_STDIN_READ,
+  TRACE_PTY_READ,
+  TRACE_PTY_WRITE,
+  TRACE_TERMINAL_WRITE,
+  TRACE_RENDER,
+  TRACE_WINDOW_SWITCH
+};
+
+/* A span of time (an instant if dur is 0) spent on something, for the window
+   WID (-1 for none) and len bytes */
+struct TraceEvent {
+  uint64_t start;
+  uint64_t dur;
+  uint16_t type;
+  int32_t WID;
+  int32_t len;
+};
+
+/* A tracer for latency debugging, cheap enough to leave compiled in
+
+   Each thread records into its own ring of TRACE_RING_EVENTS, allocated up
+   front when tracing starts (or on the thread's first event) and never
+   locked: the thread writes an event and then publishes the new count, so a
+   dump from another thread only risks the few events being written at that
+   moment. While tracing is off, every call site costs a test of one global
+   flag
+
+   traceDump() writes everything still in the rings as Chrome trace event
+   JSON (chrome://tracing, Perfetto), to tracePath if set or else
+   trace-<pid>.json in the per-user /tmp/screens-<uid> directory. It won't
+   follow a symlink at the path */
+extern bool tracing;
+extern std::string tracePath;
+
+void startTracing();
+void stopTracing();
+std::string traceFile();
+bool traceDump(const std::string &path);
+void traceRecord(uint16_t type, uint64_t start, uint64_t end, int WID,
+  int len);
+
+/* Records the time from construction to destruction, e.g. of a read(), once
+   the outcome is known */
+class TraceSpan {
+public:
+  TraceSpan(uint16_t type, int WID=-1):
+    _start(tracing ? monotonicNs() : 0),
+    _type(type),
+    _WID(WID),
+    len(0)
+  {}
+
+  ~TraceSpan()
+  {
+    if (_start) {
+      traceRecord(_type, _start, monotonicNs(), _WID, len);
+    }
+  }
+
+  TraceSpan(const TraceSpan &other) = delete;
+  TraceSpan &operator=(const TraceSpan &other) = delete;
+
+private:
+  uint64_t _start;
+  uint16_t _type;
+  int _WID;
+
+public:
+  int len;
+};
+
+inline void traceInstant(uint16_t type, int WID, int len=0)
+{
+  if (tracing) {
+    uint64_t now = monotonicNs();
+    traceRecord(type, now, now, WID, len);
+  }
+}
+
+#endif
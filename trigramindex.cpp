@@ -0,0 +1,206 @@
+#include "trigramindex.h"
+
+#include <algorithm>
+
+
+TrigramIndex::TrigramIndex():
+  _seen((1 << TRIGRAM_BUCKET_BITS) / 64),
+  _block(0),
+  _recent(0),
+  _firstBlock(0),
+  _compactedAt(0),
+  _postedBytes(0)
+{}
+
+unsigned char foldCase(unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+uint32_t trigramBucket(uint32_t trigram)
+{
+  return (trigram * 2654435761U) >> (32 - TRIGRAM_BUCKET_BITS);
+}
+
+/* Index len bytes which begin at absolute offset pos. The previous two bytes
+   are remembered, so trigrams spanning appends (and blocks) are kept */
+void TrigramIndex::append(uint64_t pos, const char *from, size_t len)
+{
+  for (size_t i=0; i<len; ++i) {
+    uint64_t block = (pos + i) / INDEX_BLOCK;
+    if (block != _block) {
+      std::fill(_seen.begin(), _seen.end(), 0);
+      _block = block;
+    }
+
+    _recent = (_recent << 8 | foldCase(from[i])) & 0xffffff;
+    if (pos + i < 2) {
+      continue;
+    }
+
+    uint32_t bucket = trigramBucket(_recent);
+    uint64_t bit = 1ULL << (bucket & 63);
+    if (!(_seen[bucket >> 6] & bit)) {
+      _seen[bucket >> 6] |= bit;
+      post(bucket, block);
+    }
+  }
+}
+
+/* Forget blocks wholly before head. Their postings are dropped in bulk once
+   there are as many dead blocks as were live at the last compaction */
+void TrigramIndex::trim(uint64_t head)
+{
+  _firstBlock = std::max(_firstBlock, head / INDEX_BLOCK);
+  if (_firstBlock - _compactedAt > _block - _firstBlock) {
+    compact();
+  }
+}
+
+/* Blocks which may contain query, as the offsets they start at, ascending.
+   With fewer than three bytes to go on, that is every block */
+std::vector<uint64_t> TrigramIndex::candidates(const std::string &query,
+  uint64_t head, uint64_t tail) const
+{
+  std::vector<uint64_t> res;
+  if (head >= tail) {
+    return res;
+  }
+
+  uint64_t first = std::max(_firstBlock, head / INDEX_BLOCK);
+  uint64_t last = (tail - 1) / INDEX_BLOCK;
+
+  std::vector<uint32_t> buckets;
+  uint32_t trigram = 0;
+  for (size_t i=0; i<query.size(); ++i) {
+    trigram = (trigram << 8 | foldCase(query[i])) & 0xffffff;
+    if (i >= 2) {
+      buckets.push_back(trigramBucket(trigram));
+    }
+  }
+  std::sort(buckets.begin(), buckets.end());
+  buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+  if (buckets.empty()) {
+    for (uint64_t block=first; block<=last; ++block) {
+      res.push_back(block * INDEX_BLOCK);
+    }
+    return res;
+  }
+
+  /* Start from the rarest bucket, so the candidate set only shrinks */
+  std::vector<std::vector<uint64_t>> lists(buckets.size());
+  for (size_t i=0; i<buckets.size(); ++i) {
+    auto it = _postings.find(buckets[i]);
+    if (it == _postings.end()) {
+      return res;
+    }
+    decode(it->second, lists[i]);
+  }
+  std::sort(lists.begin(), lists.end(),
+    [](const std::vector<uint64_t> &a, const std::vector<uint64_t> &b) {
+      return a.size() < b.size();
+    });
+
+  /* A match in block b needs each trigram in b or b + 1 */
+  std::vector<uint64_t> blocks;
+  for (uint64_t block : lists[0]) {
+    if (block && (blocks.empty() || blocks.back() != block - 1)) {
+      blocks.push_back(block - 1);
+    }
+    blocks.push_back(block);
+  }
+
+  for (size_t i=1; i<lists.size() && !blocks.empty(); ++i) {
+    const std::vector<uint64_t> &list = lists[i];
+    std::vector<uint64_t> kept;
+
+    for (uint64_t block : blocks) {
+      auto it = std::lower_bound(list.begin(), list.end(), block);
+      if (it != list.end() && *it <= block + 1) {
+        kept.push_back(block);
+      }
+    }
+    blocks.swap(kept);
+  }
+
+  for (uint64_t block : blocks) {
+    if (block >= first && block <= last) {
+      res.push_back(block * INDEX_BLOCK);
+    }
+  }
+  return res;
+}
+
+/* Postings plus the per-block bitmap */
+size_t TrigramIndex::memoryBytes() const
+{
+  return _postedBytes + _postings.size() * sizeof(Postings) +
+    _seen.size() * sizeof(uint64_t);
+}
+
+void TrigramIndex::post(uint32_t bucket, uint32_t block)
+{
+  Postings &postings = _postings[bucket];
+  uint32_t delta = block - postings.last;
+  postings.last = block;
+
+  size_t before = postings.deltas.size();
+  do {
+    unsigned char byte = delta & 0x7f;
+    delta >>= 7;
+    postings.deltas += (char) (delta ? byte | 0x80 : byte);
+  } while (delta);
+  _postedBytes += postings.deltas.size() - before;
+}
+
+/* The live blocks in postings, ascending */
+void TrigramIndex::decode(const Postings &postings,
+  std::vector<uint64_t> &blocks) const
+{
+  uint64_t block = 0;
+  uint64_t delta = 0;
+  int shift = 0;
+
+  for (unsigned char byte : postings.deltas) {
+    delta |= (uint64_t) (byte & 0x7f) << shift;
+    shift += 7;
+    if (byte & 0x80) {
+      continue;
+    }
+
+    block += delta;
+    if (block >= _firstBlock) {
+      blocks.push_back(block);
+    }
+    delta = 0;
+    shift = 0;
+  }
+}
+
+/* Re-encode every bucket without its dead blocks, dropping empty ones */
+void TrigramIndex::compact()
+{
+  std::vector<uint64_t> blocks;
+  _postedBytes = 0;
+
+  for (auto it=_postings.begin(); it!=_postings.end(); ) {
+    blocks.clear();
+    decode(it->second, blocks);
+    if (blocks.empty()) {
+      it = _postings.erase(it);
+      continue;
+    }
+
+    Postings &postings = it->second;
+    postings.last = 0;
+    postings.deltas.clear();
+    for (uint64_t block : blocks) {
+      post(it->first, block);
+    }
+    postings.deltas.shrink_to_fit();
+    ++it;
+  }
+
+  _compactedAt = _firstBlock;
+}
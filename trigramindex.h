@@ -0,0 +1,64 @@
+#ifndef TRIGRAMINDEX_H
+#define TRIGRAMINDEX_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/* Output is indexed in blocks of this many bytes */
+const size_t INDEX_BLOCK = 256 * 1024;
+
+/* Trigrams are hashed into this many buckets, see TrigramIndex */
+const int TRIGRAM_BUCKET_BITS = 16;
+
+/* Which blocks of a stream contain which trigrams (runs of three bytes, ASCII
+   letters folded to lower case), for finding substrings without scanning all
+   of it
+
+   Each trigram is hashed to one of 2^TRIGRAM_BUCKET_BITS buckets, which only
+   costs some false candidates, and filed under the block its last byte falls
+   in. A bucket's postings are the blocks it occurs in, ascending and stored as
+   varint deltas, which are mostly one byte since busy trigrams occur in most
+   blocks. They are extended as output arrives, so the block being written is
+   indexed too, and whether a bucket has been seen in it yet is one bit
+
+   A substring starting in block b, no longer than a block, has all of its
+   trigrams in b or b + 1, so the candidates are the blocks for which that
+   holds for every trigram in the query. They still have to be checked */
+class TrigramIndex {
+public:
+  TrigramIndex();
+
+  void append(uint64_t pos, const char *from, size_t len);
+  void trim(uint64_t head);
+  std::vector<uint64_t> candidates(const std::string &query, uint64_t head,
+    uint64_t tail) const;
+  size_t memoryBytes() const;
+
+private:
+  struct Postings {
+    uint32_t last;
+    std::string deltas;
+  };
+
+  void post(uint32_t bucket, uint32_t block);
+  void decode(const Postings &postings, std::vector<uint64_t> &blocks) const;
+  void compact();
+
+  std::unordered_map<uint32_t, Postings> _postings;
+  std::vector<uint64_t> _seen;
+  uint64_t _block;
+  uint32_t _recent;
+  uint64_t _firstBlock;
+  uint64_t _compactedAt;
+  size_t _postedBytes;
+};
+
+unsigned char foldCase(unsigned char c);
+uint32_t trigramBucket(uint32_t trigram);
+
+#endif
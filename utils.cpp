@@ -5,10 +5,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/resource.h>
 
@@ -61,6 +68,191 @@ void sysError(const std::string &name)
   throw std::runtime_error(name + ": " + strError(errno));
 }
 
+/* Nanoseconds on a clock which never jumps, for measuring intervals only */
+uint64_t monotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A byte count, optionally suffixed with K, M or G for powers of 1024 */
+bool parseSize(const char *str, size_t &size)
+{
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno || end == str || *str == '-' || value > SIZE_MAX) {
+    return false;
+  }
+
+  /* Each suffix is another factor of 1024 over the one before it. Sizes
+     which wouldn't fit are rejected rather than wrapped */
+  static const char suffixes[] = "KMG";
+  const char *suffix = *end ? strchr(suffixes, *end) : nullptr;
+  if (suffix) {
+    for (const char *s=suffixes; s<=suffix; ++s) {
+      if (value > SIZE_MAX / 1024) {
+        return false;
+      }
+      value *= 1024;
+    }
+    ++end;
+  }
+
+  size = value;
+  return !*end;
+}
+
+/* A whole, non-negative decimal number which fits in an int */
+bool parseCount(const char *str, int &count)
+{
+  char *end;
+  errno = 0;
+  long value = strtol(str, &end, 10);
+  if (errno || end == str || *end || value < 0 || value > INT_MAX) {
+    return false;
+  }
+
+  count = value;
+  return true;
+}
+
+/* The inverse of parseSize(), to one decimal place, e.g. 1.5M */
+std::string formatSize(uint64_t size)
+{
+  static const char units[] = "BKMGT";
+  double value = size;
+  int unit = 0;
+
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    ++unit;
+  }
+
+  char buf[32];
+  if (!unit) {
+    snprintf(buf, sizeof(buf), "%lluB", (unsigned long long) size);
+  } else {
+    snprintf(buf, sizeof(buf), "%.1f%c", value, units[unit]);
+  }
+  return buf;
+}
+
+/* Output with escape sequences and control characters other than tabs and
+   newlines removed, each newline becoming CRLF, e.g. for showing a stretch of
+   scrollback out of context. Sequences cut off at either end lose their
+   remains as plain text */
+std::string plainText(const char *buf, size_t len)
+{
+  std::string res;
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned char c = buf[i++];
+    if (c == '\n') {
+      res += "\r\n";
+    } else if (c == '\t' || (c >= 0x20 && c != 0x7f)) {
+      res += c;
+    } else if (c != 0x1b || i == len) {
+      continue;
+    } else if (buf[i] == '[') {
+      /* CSI: parameters and intermediates, then a final byte */
+      while (++i < len && (buf[i] < 0x40 || buf[i] > 0x7e));
+      ++i;
+    } else if (buf[i] == ']' || buf[i] == 'P' || buf[i] == '_') {
+      /* OSC, DCS, APC: a string ended by BEL or ST */
+      while (++i < len && buf[i] != '\a' && buf[i] != 0x1b);
+      i += i < len && buf[i] == 0x1b ? 2 : 1;
+    } else if (buf[i] >= 0x20 && buf[i] <= 0x2f) {
+      /* nF: intermediates then a final byte, e.g. charset selection */
+      i += 2;
+    } else {
+      ++i;
+    }
+  }
+
+  return res;
+}
+
+/* Unix write() may only process some of the request bytes, it may also be
+   interrupted by a signal. This helper continues writing untill all requested
+   bytes are processed, or I/O error */
+int writeAll(int fd, const char *buf, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    int res = write(fd, buf + i, len - i);
+    if (res == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    i += res;
+  }
+
+  return len;
+}
+
+/* Like writeAll(), but gathers several buffers into each write() call */
+int writevAll(int fd, struct iovec *iov, int iovcnt)
+{
+  size_t total = 0;
+
+  while (iovcnt > 0) {
+    ssize_t res = writev(fd, iov, iovcnt);
+    if (res == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += res;
+    skipIov(iov, iovcnt, res);
+  }
+
+  return total;
+}
+
+/* Skip len bytes of buffers, e.g. whatever a writev() wrote, which may end
+   partway through one */
+void skipIov(struct iovec *&iov, int &iovcnt, size_t len)
+{
+  while (iovcnt > 0 && len >= iov->iov_len) {
+    len -= iov->iov_len;
+    ++iov;
+    --iovcnt;
+  }
+  if (iovcnt > 0) {
+    iov->iov_base = (char *) iov->iov_base + len;
+    iov->iov_len -= len;
+  }
+}
+
+/* Create path as a directory only the user may enter, or check that it
+   already is one: a real directory (not a symlink), owned by the user, with
+   mode 0700. Anyone else could have made it first, e.g. under /tmp, and then
+   swapped whatever is put in it. Returns false with errno set otherwise */
+bool privateDir(const std::string &path)
+{
+  if (mkdir(path.c_str(), 0700) == -1 && errno != EEXIST) {
+    return false;
+  }
+
+  struct stat st;
+  if (lstat(path.c_str(), &st) == -1) {
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+      (st.st_mode & 07777) != 0700) {
+    errno = EPERM;
+    return false;
+  }
+  return true;
+}
+
 /* Soft limit, returned here, is the kernel-enforced limit for a resource while
    hard limit is its ceiling. An unprivileged process may set its soft limit up
    to its hard one, but not over. A privileged process may change either! */
@@ -133,16 +325,33 @@ bool setTerminalRawio()
   return false;
 }
 
+/* Size of the controlling terminal, or the traditional 24x80 if stdin is not
+   a terminal or doesn't know its size */
+void terminalSize(int &rows, int &cols)
+{
+  struct winsize ws;
+
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1 || !ws.ws_row || !ws.ws_col) {
+    rows = 24;
+    cols = 80;
+  } else {
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+  }
+}
+
 /* Create a pseudo-terminal pair
 
    Note: standards define O_NOCTTY for opening a PTY without it becoming the
    controlling terminal of the calling process, but this seems to be included
-   for compatibility reasons */
+   for compatibility reasons. The master is close-on-exec, so that windows'
+   shells don't hold each other's PTYs open */
 int makePTY()
 {
   int fdm = posix_openpt(O_RDWR | O_NOCTTY);
   if (fdm != -1) {
-    if (grantpt(fdm) != -1 && unlockpt(fdm) != -1) {
+    if (grantpt(fdm) != -1 && unlockpt(fdm) != -1 &&
+        fcntl(fdm, F_SETFD, FD_CLOEXEC) != -1) {
       return fdm;
     }
     close(fdm);
@@ -150,3 +359,13 @@ int makePTY()
 
   return -1;
 }
+
+/* A fresh PTY reports a 0x0 size, which full-screen programs can't lay out */
+bool setPTYSize(int fdm, int rows, int cols)
+{
+  struct winsize ws = {};
+  ws.ws_row = rows;
+  ws.ws_col = cols;
+
+  return ioctl(fdm, TIOCSWINSZ, &ws) != -1;
+}
@@ -3,17 +3,33 @@
 
 #include <string>
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 
 std::string strError(int err);
 void sysError(const std::string &name);
 
+uint64_t monotonicNs();
+bool parseSize(const char *str, size_t &size);
+bool parseCount(const char *str, int &count);
+bool privateDir(const std::string &path);
+std::string formatSize(uint64_t size);
+std::string plainText(const char *buf, size_t len);
+
+int writeAll(int fd, const char *buf, size_t len);
+int writevAll(int fd, struct iovec *iov, int iovcnt);
+void skipIov(struct iovec *&iov, int &iovcnt, size_t len);
+
 int maxFds();
 bool daemonizeStddes(std::string path="");
 bool resetStddes(int fd);
 
 void unsetTerminalRawIO();
 bool setTerminalRawio();
+void terminalSize(int &rows, int &cols);
 
 int makePTY();
+bool setPTYSize(int fdm, int rows, int cols);
 
 #endif
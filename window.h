@@ -2,31 +2,61 @@
 #define WINDOW_H
 
 #include "ringbuffer.h"
+#include "screen.h"
+#include "scrollback.h"
+#include "spawner.h"
+#include "stats.h"
 #include "utils.h"
 
+#include <string>
 #include <utility>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 
+/* Input a window's child hasn't read yet is queued up to this many bytes */
+const size_t INPUT_QUEUE_BYTES = 1024 * 1024;
+
 /* A list of Windows is maintained by the server
 
-   PTY: only master FD needed
-   Circular buffer: last N bytes written to stdout/stderr
+   PTY: only master FD needed, which is non-blocking so that a child not
+        reading its input only ever holds up itself
+   Scrollback: last N bytes written to stdout/stderr, indexed by line, the
+               older ones spilled to disk under spillDir if given
+   Screen: what a terminal showing the window would currently display
    WID: window ID displayed to the user
+   spec: what it runs
    PID: process ID, used by server to detect exited children on any SIGCHLD
         (although assuming no unexpected termination child exit can be
-         determined by reading EOF from its fdm) */
+         determined by reading EOF from its fdm)
+   lastActive: when it last output anything or was current, for deciding
+               whose scrollback to trim first
+   pendingInput: input written to fdm as it becomes writable, whose pages
+                 are only touched once a child falls behind
+   stats: counters for the stats overlay, see WindowStats */
 struct Window {
-  Window(int WID, size_t capacity):
-    buffer(capacity),
+  Window(int WID, size_t capacity, const std::string &spillDir, int rows,
+    int cols):
     WID(WID),
-    PID(-1)
+    PID(-1),
+    lastActive(monotonicNs()),
+    buffer(capacity, spillDir),
+    screen(rows, cols),
+    pendingInput(INPUT_QUEUE_BYTES)
   {
     if ((fdm = makePTY()) == -1) {
       sysError("makePTY");
     }
+    if (!setPTYSize(fdm, rows, cols)) {
+      close(fdm);
+      sysError("setPTYSize");
+    }
+    if (fcntl(fdm, F_SETFL, O_NONBLOCK) == -1) {
+      close(fdm);
+      sysError("fcntl");
+    }
   }
 
   Window(const Window &other) = delete;
@@ -36,7 +66,12 @@ struct Window {
     fdm(other.fdm),
     WID(),
     PID(),
-    buffer(std::move(other.buffer))
+    lastActive(other.lastActive),
+    buffer(std::move(other.buffer)),
+    screen(std::move(other.screen)),
+    spec(std::move(other.spec)),
+    pendingInput(std::move(other.pendingInput)),
+    stats(other.stats)
   {
     other.fdm = -1;
   }
@@ -51,7 +86,12 @@ struct Window {
   int fdm;
   int WID;
   pid_t PID;
-  RingBuffer buffer;
+  uint64_t lastActive;
+  Scrollback buffer;
+  Screen screen;
+  SpawnSpec spec;
+  RingBuffer pendingInput;
+  WindowStats stats;
 };
 
 #endif